@@ -1,39 +1,110 @@
 /* NDFileRaw.cpp
- * Dummy file writer, whose main purpose is to allow deleting original driver files without re-writing them in 
- * an actual file plugin.
+ * Writes NDArrays to raw files.
  *
- * Mark Rivers
- * November 30, 2011
+ * Keenan Lang
+ * October 5th, 2016
  */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h> 
+#include <errno.h>
+#include <sys/mman.h>
 
-#include <epicsTypes.h>
-#include <epicsMessageQueue.h>
+#include <epicsStdio.h>
+#include <epicsString.h>
+#include <epicsTime.h>
 #include <epicsThread.h>
 #include <epicsEvent.h>
-#include <epicsTime.h>
 #include <iocsh.h>
+#define epicsAssertAuthor "the EPICS areaDetector collaboration (https://github.com/areaDetector/ADCore/issues)"
+#include <epicsAssert.h>
 
 #include <asynDriver.h>
 
 #include <epicsExport.h>
 #include "NDFileRaw.h"
+#include "NDFileRawFormat.h"
+
 
 static const char *driverName = "NDFileRaw";
 
-/** Opens a Raw file.
-  * \param[in] fileName The name of the file to open.
-  * \param[in] openMode Mask defining how the file should be opened; bits are 
-  *            NDFileModeRead, NDFileModeWrite, NDFileModeAppend, NDFileModeMultiple
-  * \param[in] pArray A pointer to an NDArray; this is used to determine the array and attribute properties.
-  */
+/* What backpressureAction decided to do with a frame */
+enum {
+	bpActionWrite,
+	bpActionSkip,
+	bpActionSpill,
+	bpActionProbe          /* Written to the primary file while spilling, to measure it */
+};
+
+static const char *bpActionNames[] = {"write", "skip", "spill", "probe"};
+
+#define BP_WATCHDOG_PERIOD 0.02
+
+static int systemAllocate(int fd, off_t offset, off_t length)
+{
+	return posix_fallocate(fd, offset, length);
+}
+
+static void *systemMap(size_t length, int fd, off_t offset)
+{
+	return mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, offset);
+}
+
+static int systemSyncRange(int fd, off_t offset, off_t nbytes, unsigned int flags)
+{
+	return sync_file_range(fd, offset, nbytes, flags);
+}
+
+const NDFileRawIO_t NDFileRawSystemIO = {
+	write,
+	systemAllocate,
+	systemMap,
+	munmap,
+	systemSyncRange
+};
+
+/* write() that retries after EINTR and short writes; returns 0, or -1 with errno set */
+static int writeAll(const NDFileRawIO_t *pIO, int fd, const void *pData, size_t nbytes)
+{
+	const char *p = (const char *)pData;
+
+	while (nbytes > 0)
+	{
+		ssize_t n = pIO->write(fd, p, nbytes);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (n == 0)
+		{
+			errno = ENOSPC;
+			return -1;
+		}
+		p += n;
+		nbytes -= n;
+	}
+	return 0;
+}
+
+/* Drops whatever a failed write left past start so the file ends on a whole frame */
+static void rewindTo(int fd, off_t start)
+{
+	if (ftruncate(fd, start) == 0) lseek(fd, start, SEEK_SET);
+}
+
 asynStatus NDFileRaw::openFile(const char *fileName, NDFileOpenMode_t openMode, NDArray *pArray)
 {
 	static const char *functionName = "openFile";
-
+	asynStatus status;
+//printf("In Raw File Open . . . \n");
 	asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s Filename: %s\n", driverName, functionName, fileName);
 
 	// We don't support reading yet
@@ -64,12 +135,41 @@ asynStatus NDFileRaw::openFile(const char *fileName, NDFileOpenMode_t openMode,
 	}
 	
 	// Check to see if a file is already open and close it
-	if (this->file.is_open())    { this->closeFile(); }
+//	if (this->file.is_open())    { this->closeFile(); }
+//	 if (pRawFile != NULL) {
+	 if (rfile >= 0) 
+	{
+//		fclose(pRawFile);
+		this->closeFile();
+	}
+
+	int mmapWindowMB, mmapSyncMB;
+	this->lock();
+	getIntegerParam(NDFileRawOutputMode, &outputMode);
+	getIntegerParam(NDFileRawMmapWindow, &mmapWindowMB);
+	getIntegerParam(NDFileRawMmapSyncInterval, &mmapSyncMB);
+	getIntegerParam(NDFileRawMmapHugePages, &hugePages);
+	mmapWindowMB = std::max(1, std::min(mmapWindowMB, 4096));
+	setIntegerParam(NDFileRawMmapWindow, mmapWindowMB);
+	this->unlock();
 
 	// Create the new file
-	this->file.open(fileName, std::ofstream::binary);
+//	this->file.fopen(fileName, std::ofstream::binary);
+//	pRawFile = fopen(fileName, "wb");
+//	rfile = open(fileName, O_CREAT|O_TRUNC|O_WRONLY|O_DIRECT, S_IRWXU);
+	if (outputMode == NDFileRawModeMmap)
+	{
+		// Mappings go through the page cache, so no O_DIRECT, and a shared mapping needs read access
+		rfile = open(fileName, O_CREAT|O_TRUNC|O_RDWR, 0777);
+	}
+	else
+	{
+		rfile = open(fileName, O_CREAT|O_TRUNC|O_WRONLY|O_DIRECT, 0777);
+	}
 	
-	if (! this->file.is_open())
+//	if (! this->file.is_open())
+//	if (pRawFile == NULL) 
+	if (rfile == -1) 
 	{
 		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, 
 				  "%s::%s ERROR Failed to create a new output file\n",
@@ -78,23 +178,233 @@ asynStatus NDFileRaw::openFile(const char *fileName, NDFileOpenMode_t openMode,
 	}
 	
 	// Write 8192 byte header, currently just zeroes.
-	char header[8192] = {0};
-	
-	this->file.write(header, 8192);
+//	char header[8192] = {0};
+//512 byte header int is 4 bytes
+/*
+struct fullheader {
+int header[17] = {0};
+
+header[0] = pArray->dataType;
+header[1] = pArray->ndims;
+header[2] = pArray->dims[0].size;
+header[3] = pArray->dims[1].size;
+header[4] = pArray->dims[0].offset;
+header[5] = pArray->dims[1].offset;
+header[6] = pArray->dims[0].binning;
+header[7] = pArray->dims[1].binning;
+header[8] = pArray->dims[0].reverse;
+header[9] = pArray->dims[1].reverse;
+header[10] = 123456;
+header[11] = 234567;
+header[12] = 345678;
+header[13] = 456789;
+header[14] = 567890;
+header[15] = 678901;
+header[16] = pArray->uniqueid;
+header[17] = pArray->datasize;
+double headerd = pArray->timeStamp;
+epicsTimeStamp headere = pArray->epicsTS;
+int filler [190]= {0};
+};
+
+*/
+fullheader full_header;
+fullheader *ptr;
+int flat, dark;
+
+#define STRING_BUFFER_SIZE 2048
+
+    NDAttribute *pAttribute = NULL;
+
+ptr = &full_header;
+/*
+full_header.header[0] = pArray->dataType;
+full_header.header[1] = pArray->ndims;
+full_header.header[2] = pArray->dims[0].size;
+full_header.header[3] = pArray->dims[1].size;
+full_header.header[4] = pArray->dims[0].offset;
+full_header.header[5] = pArray->dims[1].offset;
+full_header.header[6] = pArray->dims[0].binning;
+full_header.header[7] = pArray->dims[1].binning;
+full_header.header[8] = pArray->dims[0].reverse;
+full_header.header[9] = pArray->dims[1].reverse;
+full_header.header[10] = 123456;
+full_header.header[11] = 234567;
+full_header.header[12] = 345678;
+full_header.header[13] = 456789;
+full_header.header[14] = 567890;
+full_header.header[15] = 678901;
+full_header.header[16] = pArray->uniqueId;
+full_header.header[17] = pArray->dataSize;
+full_header.headerd = pArray->timeStamp;
+full_header.headere = pArray->epicsTS;
+*/
+
+   this->pFileAttributes->clear();
+   this->getAttributes(this->pFileAttributes);
+   pArray->pAttributeList->copy(this->pFileAttributes);
+ 
+    full_header.flat = 0;
+    full_header.dark = 0;
+    
+    printf("Number of attributes %d\n",this->pFileAttributes->count());
+   printf("Number of attributes List %d\n",pArray->pAttributeList->count());
+    
+    pAttribute = this->pFileAttributes->find("flat");
+    if (pAttribute) {
+        pAttribute->getValue(NDAttrInt32, &flat);
+        full_header.flat = flat;
+ //       printf("Flat is %d \n",flat);
+  } else
+  {
+//          printf("No Flat %d \n");
+  }
+  
+     pAttribute = this->pFileAttributes->find("dark");
+    if (pAttribute) {
+        pAttribute->getValue(NDAttrInt32, &dark);
+        full_header.dark = dark;
+ //       printf("Dark is %d \n",dark);
+  } else
+  {
+//          printf("No Dark  %d \n");
+  }
+    
+
+full_header.datatype = pArray->dataType;
+full_header.ndims = pArray->ndims;
+full_header.dims0size = pArray->dims[0].size;
+full_header.dims1size = pArray->dims[1].size;
+full_header.dims0offset = pArray->dims[0].offset;
+full_header.dims1offset = pArray->dims[1].offset;
+full_header.dims0binning = pArray->dims[0].binning;
+full_header.dims1binning = pArray->dims[1].binning;
+full_header.dims0reverse = pArray->dims[0].reverse;
+full_header.dims1reverse = pArray->dims[1].reverse;
+full_header.constant1 = 123456;
+full_header.constant2 = 234567;
+full_header.constant3 = 345678;
+full_header.constant4 = 456789;
+full_header.constant5 = 567890;
+full_header.constant6 = 678901;
+full_header.uniqueid = pArray->uniqueId;
+full_header.datasize = pArray->dataSize;
+full_header.timestamp = pArray->timeStamp;
+full_header.epicsts = pArray->epicsTS;
+
+  memset(full_header.filler, 0, sizeof(full_header.filler));
+
+
 	
+//	this->file.write(header, 8192);
+//	fwrite(header, 8192, pRawFile);
+
+	// Reset the per-file instrumentation
+	pMap = NULL;
+	mapOffset = 0;
+	mapLength = 0;
+	fileOffset = 0;
+	dirtyBytes = 0;
+	wbIssued = 0;
+	wbPrevIssued = 0;
+	wbDone = 0;
+	numRemaps = 0;
+	remapSeconds = 0.;
+	writeSeconds = 0.;
+	bytesWritten = 0.;
+	this->lock();
+	setIntegerParam(NDFileRawMmapRemaps, 0);
+	setDoubleParam(NDFileRawMmapRemapTime, 0.);
+	setDoubleParam(NDFileRawMmapWritebackLag, 0.);
+	setDoubleParam(NDFileRawWriteTime, 0.);
+	setDoubleParam(NDFileRawWriteRate, 0.);
+	this->unlock();
+
+	openBackpressure(fileName, ptr, sizeof(full_header));
+
+	if (outputMode == NDFileRawModeMmap)
+	{
+		// Windows must start on a page boundary, and on a huge page boundary if we want THP to back them
+		mapAlign = sysconf(_SC_PAGESIZE);
+		if (hugePages && (mapAlign < 2*1024*1024)) mapAlign = 2*1024*1024;
+		mapLength = ((size_t)mmapWindowMB*1024*1024 + mapAlign - 1) / mapAlign * mapAlign;
+		syncBytes = (mmapSyncMB > 0) ? (size_t)mmapSyncMB*1024*1024 : 0;
+
+		status = writeMapped(ptr, sizeof(full_header), roundUp(sizeof(full_header),512));
+	}
+	else
+	{
+		status = writeDirect(ptr, sizeof(full_header));
+	}
+
+	// Don't leave a file without a header open for writeFile
+	if (status != asynSuccess) this->closeFile();
+
+	return status;
 
-    return(asynSuccess);
 }
 
-/** Writes single NDArray to the Raw file.
-  * \param[in] pArray Pointer to the NDArray to be written
+/** Copies data into alignedbuffer, zero pads it to a multiple of 512 bytes and writes it to the
+  * O_DIRECT file.  alignedbuffer grows to fit the largest frame seen since the file was opened.
+  * \param[in] pData Data to write.
+  * \param[in] nbytes Number of bytes of data.
+  */
+asynStatus NDFileRaw::writeDirect(const void *pData, size_t nbytes)
+{
+	static const char *functionName = "writeDirect";
+	size_t padded = roundUp(nbytes,512);
+
+	if (padded > alignedsize)
+	{
+		free(alignedbuffer);
+		alignedbuffer = NULL;
+		alignedsize = 0;
+		if (posix_memalign(&alignedbuffer, 512, padded) != 0)
+		{
+			alignedbuffer = NULL;
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, 
+					  "%s::%s ERROR allocating %lu byte aligned buffer\n",
+					  driverName, functionName, (unsigned long)padded);
+			return asynError;
+		}
+		alignedsize = padded;
+	}
+
+	memcpy(alignedbuffer, pData, nbytes);
+	memset((char *)alignedbuffer + nbytes, 0, padded - nbytes);
+
+	off_t start = lseek(rfile, 0, SEEK_CUR);
+	if (writeAll(pIO, rfile, alignedbuffer, padded) != 0)
+	{
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, 
+				  "%s::%s ERROR writing %lu bytes: %s\n",
+				  driverName, functionName, (unsigned long)padded, strerror(errno));
+		rewindTo(rfile, start);
+		return asynError;
+	}
+
+	return asynSuccess;
+}
+
+
+
+
+/** Writes NDArray data to a raw file.
+  * \param[in] pArray Pointer to an NDArray to write to the file. This function can be called multiple
+  *            times between the call to openFile and closeFile if NDFileModeMultiple was set in 
+  *            openMode in the call to NDFileRaw::openFile.
   */
 asynStatus NDFileRaw::writeFile(NDArray *pArray)
 {
 	asynStatus status = asynSuccess;
 	static const char *functionName = "writeFile";
+	long size;
+	
+//	printf("In Raw File Write . . . \n");
 
-	if (! this->file.is_open())
+//	if (! this->file.is_open())
+//	if (pRawFile == NULL) 
+	if (rfile == -1)
 	{
 		asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
 				  "%s::%s file is not open!\n", 
@@ -102,27 +412,524 @@ asynStatus NDFileRaw::writeFile(NDArray *pArray)
 		return asynError;
 	}
 
-	this->file.write((const char*) pArray->pData, pArray->dims[0].size * pArray->dims[1].size * 2);
+	int action = backpressureAction(pArray);
+	if (action == bpActionSpill)
+	{
+		// Nothing reaches the primary file, so bpLatency is left alone until the next measured write
+		if (writeSpill(pArray) == asynSuccess)
+		{
+			this->lock();
+			setIntegerParam(NDFileRawBPSpilled, ++bpSpilled);
+			this->unlock();
+			logDecision(pArray->uniqueId, "spill", bpLatency);
+			return asynSuccess;
+		}
+
+		// The primary disk may still be fine, so keep this frame there and stop spilling
+		logDecision(pArray->uniqueId, "spillfailed", bpLatency);
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, 
+				  "%s::%s spill file failed, falling back to Signal\n",
+				  driverName, functionName);
+		close(spillFile);
+		spillFile = -1;
+		epicsMutexLock(bpMutex);
+		bpPolicy = NDFileRawBPSignal;
+		if (bpLog) fprintf(bpLog, "# spill write failed, policy=%d\n", NDFileRawBPSignal);
+		epicsMutexUnlock(bpMutex);
+		action = bpActionWrite;
+	}
+	if (action == bpActionSkip)
+	{
+		this->lock();
+		setIntegerParam(NDFileRawBPSkipped, ++bpSkipped);
+		this->unlock();
+		logDecision(pArray->uniqueId, "skip", bpLatency);
+		return status;
+	}
+
+//	this->file.write((const char*) pArray->pData, pArray->dims[0].size * pArray->dims[1].size );
+
+//	fwrite((const char*)pArray->pData, 1, pArray->dataSize, pRawFile);
+
+	epicsTimeStamp tStart, tEnd;
+	epicsTimeGetCurrent(&tStart);
+
+	// Let the watchdog see how long this write has been running if it stalls
+	epicsMutexLock(bpMutex);
+	bpWriting = 1;
+	bpWritingId = pArray->uniqueId;
+	bpWriteStart = tStart;
+	epicsMutexUnlock(bpMutex);
+
+	if (outputMode == NDFileRawModeMmap)
+	{
+		status = writeMapped(pArray->pData, pArray->dataSize, roundUp(pArray->dataSize,512));
+	}
+	else
+	{
+		status = writeDirect(pArray->pData, pArray->dataSize);
+	}
+
+	epicsTimeGetCurrent(&tEnd);
+	double elapsed = epicsTimeDiffInSeconds(&tEnd, &tStart);
+	writeSeconds += elapsed;
+	bytesWritten += pArray->dataSize;
+
+	// NDPluginFile calls writeFile without the port lock, and the watchdog shares these parameters
+	this->lock();
+	epicsMutexLock(bpMutex);
+	bpWriting = 0;
+	bpLatency = 0.8*bpLatency + 0.2*elapsed*1000.;
+	epicsMutexUnlock(bpMutex);
+	setDoubleParam(NDFileRawWriteTime, elapsed*1000.);
+	setDoubleParam(NDFileRawBPLatency, bpLatency);
+	if ((action == bpActionProbe) || bpBehind) logDecision(pArray->uniqueId, bpActionNames[action], elapsed*1000.);
+	if (writeSeconds > 0.) setDoubleParam(NDFileRawWriteRate, bytesWritten/writeSeconds/(1024.*1024.));
+	if (outputMode == NDFileRawModeMmap)
+	{
+		setIntegerParam(NDFileRawMmapRemaps, numRemaps);
+		setDoubleParam(NDFileRawMmapRemapTime, numRemaps ? remapSeconds*1000./numRemaps : 0.);
+		setDoubleParam(NDFileRawMmapWritebackLag, (fileOffset - wbDone)/(1024.*1024.));
+	}
+	this->unlock();
+
+//printf("got past here \n");
+
+//	fwrite((const char*)pArray->pData, 1, pArray->dataSize, pRawFile);
+
 
-    return(asynSuccess);
+	return status;
 }
 
-/** Reads single NDArray from a Raw file; NOT CURRENTLY IMPLEMENTED.
-  * \param[in] pArray Pointer to the NDArray to be read
+/** Starts backpressure monitoring for a new file.  Unless the policy is Off, every decision is
+  * recorded in <fileName>.bplog.  For the Spill policy the spill file <spill path>/<file>.spill
+  * is created with the same header as the primary file, so it can be read like any raw file.
+  * \param[in] fileName Name of the primary file.
+  * \param[in] pHeader Header written to the primary file.
+  * \param[in] headerSize Size of the header in bytes.
   */
-asynStatus NDFileRaw::readFile(NDArray **pArray)
+asynStatus NDFileRaw::openBackpressure(const char *fileName, const void *pHeader, size_t headerSize)
 {
-    return asynError;
+	static const char *functionName = "openBackpressure";
+	char logName[MAX_FILENAME_LEN+8], spillPath[MAX_FILENAME_LEN], spillName[2*MAX_FILENAME_LEN];
+	int policy, decimation, probeInterval;
+
+	this->lock();
+	epicsMutexLock(bpMutex);
+	getIntegerParam(NDFileRawBPPolicy, &policy);
+	getDoubleParam(NDFileRawBPLatencyLimit, &bpLatencyLimit);
+	getIntegerParam(NDFileRawBPQueueLimit, &bpQueueLimit);
+	getIntegerParam(NDFileRawBPDecimation, &decimation);
+	getIntegerParam(NDFileRawBPProbeInterval, &probeInterval);
+	getStringParam(NDFileRawBPSpillPath, sizeof(spillPath), spillPath);
+
+	bpPolicy = policy;
+	bpWriting = 0;
+	bpBehind = 0;
+	bpBehindFrames = 0;
+	bpSkipped = 0;
+	bpSpilled = 0;
+	bpLatency = 0.;
+	setIntegerParam(NDFileRawBPSlowDown, 0);
+	setIntegerParam(NDFileRawBPSkipped, 0);
+	setIntegerParam(NDFileRawBPSpilled, 0);
+	setDoubleParam(NDFileRawBPLatency, 0.);
+	epicsMutexUnlock(bpMutex);
+	this->unlock();
+
+	if (policy == NDFileRawBPOff) return asynSuccess;
+
+	epicsSnprintf(logName, sizeof(logName), "%s.bplog", fileName);
+	bpLog = fopen(logName, "w");
+	if (bpLog == NULL)
+	{
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, 
+				  "%s::%s ERROR cannot create decision log %s: %s\n",
+				  driverName, functionName, logName, strerror(errno));
+	}
+	else
+	{
+		fprintf(bpLog, "# policy=%d latencyLimit=%.3fms queueLimit=%d%% decimation=%d probeInterval=%d spillPath=%s\n",
+				policy, bpLatencyLimit, bpQueueLimit, decimation, probeInterval, spillPath);
+		fprintf(bpLog, "# uniqueId decision latency(ms) queueUse(%%)\n");
+		fprintf(bpLog, "# latency is the smoothed write time for behind/caughtup, the in-flight time for stalled,\n"
+		               "# and the time of that write for write/probe\n");
+	}
+
+	if ((policy == NDFileRawBPSpill) && (spillPath[0] == '\0'))
+	{
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, 
+				  "%s::%s ERROR no spill path set, falling back to Signal\n",
+				  driverName, functionName);
+		if (bpLog) fprintf(bpLog, "# no spill path set, policy=%d\n", NDFileRawBPSignal);
+		policy = NDFileRawBPSignal;
+	}
+	else if (policy == NDFileRawBPSpill)
+	{
+		const char *baseName = strrchr(fileName, '/');
+		baseName = baseName ? baseName+1 : fileName;
+		epicsSnprintf(spillName, sizeof(spillName), "%s/%s.spill", spillPath, baseName);
+		spillFile = open(spillName, O_CREAT|O_TRUNC|O_WRONLY, 0777);
+		if ((spillFile == -1) || (writeAll(pIO, spillFile, pHeader, headerSize) != 0))
+		{
+			// Still tell upstream to slow down rather than losing frames silently
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, 
+					  "%s::%s ERROR cannot create spill file %s, falling back to Signal: %s\n",
+					  driverName, functionName, spillName, strerror(errno));
+			if (bpLog) fprintf(bpLog, "# cannot create spill file %s, policy=%d\n", spillName, NDFileRawBPSignal);
+			if (spillFile != -1) close(spillFile);
+			spillFile = -1;
+			policy = NDFileRawBPSignal;
+		}
+	}
+
+	epicsMutexLock(bpMutex);
+	bpPolicy = policy;
+	bpActive = 1;
+	epicsMutexUnlock(bpMutex);
+	epicsEventSignal(bpWatchdogEvent);
+
+	return asynSuccess;
 }
 
+/** Updates the behind/caught up state from the smoothed write latency and the queue use, and
+  * decides what to do with pArray.  Entering and leaving the behind state use thresholds a factor
+  * of 2 apart so the state does not flap on every frame.  bpLatency only changes on measured writes
+  * to the primary file, so while spilling every Nth frame is sent there as a probe; under
+  * Decimate the frames that are still written do the measuring.  Falling behind during a stalled
+  * write is detected by bpWatchdog.
+  * \param[in] pArray The array about to be written.
+  * \return bpActionWrite, bpActionSkip, bpActionSpill or bpActionProbe.
+  */
+int NDFileRaw::backpressureAction(NDArray *pArray)
+{
+	static const char *functionName = "backpressureAction";
+	int decimation, probeInterval, queueSize, queueFree;
+	int behind, action = bpActionWrite;
 
-/** Closes the Raw file. */
+	this->lock();
+	getIntegerParam(NDPluginDriverQueueSize, &queueSize);
+	getIntegerParam(NDPluginDriverQueueFree, &queueFree);
+	getIntegerParam(NDFileRawBPDecimation, &decimation);
+	getIntegerParam(NDFileRawBPProbeInterval, &probeInterval);
+	if (decimation < 1) decimation = 1;
+	if (probeInterval < 1) probeInterval = 1;
+
+	epicsMutexLock(bpMutex);
+	getDoubleParam(NDFileRawBPLatencyLimit, &bpLatencyLimit);
+	getIntegerParam(NDFileRawBPQueueLimit, &bpQueueLimit);
+	bpQueueUse = (queueSize > 0) ? 100*(queueSize - queueFree)/queueSize : 0;
+	setIntegerParam(NDFileRawBPQueueUse, bpQueueUse);
+
+	if (bpPolicy == NDFileRawBPOff)
+	{
+		epicsMutexUnlock(bpMutex);
+		this->unlock();
+		return bpActionWrite;
+	}
+
+	if (!bpBehind)
+	{
+		behind = ((bpLatencyLimit > 0.) && (bpLatency > bpLatencyLimit)) ||
+		         ((bpQueueLimit > 0) && (bpQueueUse > bpQueueLimit));
+	}
+	else
+	{
+		behind = !(((bpLatencyLimit <= 0.) || (bpLatency < bpLatencyLimit/2.)) &&
+		           ((bpQueueLimit <= 0) || (bpQueueUse < bpQueueLimit/2)));
+	}
+
+	if (behind != bpBehind)
+	{
+		bpBehind = behind;
+		bpBehindFrames = 0;
+		setIntegerParam(NDFileRawBPSlowDown, bpBehind);
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_WARNING, 
+				  "%s::%s %s at uniqueId %d, latency %.3f ms, queue use %d%%\n",
+				  driverName, functionName, bpBehind ? "falling behind" : "caught up",
+				  pArray->uniqueId, bpLatency, bpQueueUse);
+		if (bpLog) fprintf(bpLog, "%d %s %.3f %d\n", pArray->uniqueId, bpBehind ? "behind" : "caughtup",
+						   bpLatency, bpQueueUse);
+	}
+
+	if (bpBehind)
+	{
+		if (bpPolicy == NDFileRawBPDecimate)
+		{
+			if (bpBehindFrames % decimation) action = bpActionSkip;
+		}
+		else if (bpPolicy == NDFileRawBPSpill)
+		{
+			action = (bpBehindFrames % probeInterval) ? bpActionSpill : bpActionProbe;
+		}
+		bpBehindFrames++;
+	}
+	epicsMutexUnlock(bpMutex);
+	this->unlock();
+
+	return action;
+}
+
+/** Records what was done with a frame while behind in the decision log.
+  * \param[in] uniqueId The frame's uniqueId.
+  * \param[in] decision What was done with it.
+  * \param[in] latency Latency in ms to record with it.
+  */
+void NDFileRaw::logDecision(int uniqueId, const char *decision, double latency)
+{
+	epicsMutexLock(bpMutex);
+	if (bpLog) fprintf(bpLog, "%d %s %.3f %d\n", uniqueId, decision, latency, bpQueueUse);
+	epicsMutexUnlock(bpMutex);
+}
+
+/** Watchdog thread.  writeFile runs the backpressure check on the writer thread, which is stuck
+  * inside write() when the disk stalls.  While a file is open with a policy other than Off, this
+  * thread samples the in-flight write time and the queue use every BP_WATCHDOG_PERIOD seconds and
+  * asserts NDFileRawBPSlowDown as soon as either passes its limit; writeFile then applies the policy
+  * and decides when the writer has caught up.  Otherwise it waits on bpWatchdogEvent.
+  */
+void NDFileRaw::bpWatchdog()
+{
+	static const char *functionName = "bpWatchdog";
+	epicsTimeStamp now;
+	int queueSize, queueFree, queueUse;
+
+	while (1)
+	{
+		// Sleep until openBackpressure starts monitoring a file
+		epicsMutexLock(bpMutex);
+		int active = bpActive;
+		epicsMutexUnlock(bpMutex);
+		if (!active)
+		{
+			epicsEventMustWait(bpWatchdogEvent);
+			continue;
+		}
+
+		epicsThreadSleep(BP_WATCHDOG_PERIOD);
+
+		this->lock();
+		getIntegerParam(NDPluginDriverQueueSize, &queueSize);
+		getIntegerParam(NDPluginDriverQueueFree, &queueFree);
+		queueUse = (queueSize > 0) ? 100*(queueSize - queueFree)/queueSize : 0;
+
+		epicsMutexLock(bpMutex);
+		if (bpActive && !bpBehind)
+		{
+			double inflight = 0.;
+			if (bpWriting)
+			{
+				epicsTimeGetCurrent(&now);
+				inflight = epicsTimeDiffInSeconds(&now, &bpWriteStart)*1000.;
+			}
+			if (((bpLatencyLimit > 0.) && (inflight > bpLatencyLimit)) ||
+			    ((bpQueueLimit > 0) && (queueUse > bpQueueLimit)))
+			{
+				bpBehind = 1;
+				bpBehindFrames = 0;
+				bpQueueUse = queueUse;
+				setIntegerParam(NDFileRawBPSlowDown, 1);
+				setIntegerParam(NDFileRawBPQueueUse, queueUse);
+				asynPrint(this->pasynUserSelf, ASYN_TRACE_WARNING, 
+						  "%s::%s falling behind during uniqueId %d, write in progress for %.3f ms, queue use %d%%\n",
+						  driverName, functionName, bpWritingId, inflight, queueUse);
+				if (bpLog)
+				{
+					fprintf(bpLog, "%d stalled %.3f %d\n", bpWritingId, inflight, queueUse);
+					fflush(bpLog);
+				}
+				callParamCallbacks();
+			}
+		}
+		epicsMutexUnlock(bpMutex);
+		this->unlock();
+	}
+}
+
+static void bpWatchdogC(void *drvPvt)
+{
+	NDFileRaw *pPvt = (NDFileRaw *)drvPvt;
+
+	pPvt->bpWatchdog();
+}
+
+/** Writes one frame to the spill file, padded to 512 bytes like the primary file.
+  * \param[in] pArray The array to write.
+  */
+asynStatus NDFileRaw::writeSpill(NDArray *pArray)
+{
+	static const char *functionName = "writeSpill";
+	static const char zeroes[512] = {0};
+	size_t padding = roundUp(pArray->dataSize,512) - pArray->dataSize;
+	off_t start = lseek(spillFile, 0, SEEK_CUR);
+
+	if ((writeAll(pIO, spillFile, pArray->pData, pArray->dataSize) != 0) ||
+	    (writeAll(pIO, spillFile, zeroes, padding) != 0))
+	{
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, 
+				  "%s::%s ERROR writing uniqueId %d to spill file: %s\n",
+				  driverName, functionName, pArray->uniqueId, strerror(errno));
+		rewindTo(spillFile, start);
+		return asynError;
+	}
+	return asynSuccess;
+}
+
+/** Closes the spill file and the decision log, recording the totals. */
+void NDFileRaw::closeBackpressure()
+{
+	if (spillFile != -1) close(spillFile);
+	spillFile = -1;
+	this->lock();
+	epicsMutexLock(bpMutex);
+	bpActive = 0;
+	if (bpLog)
+	{
+		fprintf(bpLog, "# skipped=%d spilled=%d\n", bpSkipped, bpSpilled);
+		fclose(bpLog);
+	}
+	bpLog = NULL;
+	bpBehind = 0;
+	setIntegerParam(NDFileRawBPSlowDown, 0);
+	epicsMutexUnlock(bpMutex);
+	this->unlock();
+}
+
+/** Starts writeback of everything copied since the last call, then waits for the range requested
+  * two calls ago so the confirmed offset trails the copy by at most two sync intervals.
+  * msync(MS_ASYNC) is a no-op on Linux, so sync_file_range is used instead.
+  */
+void NDFileRaw::startWriteback()
+{
+	if (fileOffset <= wbIssued) return;
+
+	pIO->syncRange(rfile, wbIssued, fileOffset - wbIssued, SYNC_FILE_RANGE_WRITE);
+	if (wbPrevIssued > wbDone)
+	{
+		pIO->syncRange(rfile, wbDone, wbPrevIssued - wbDone, SYNC_FILE_RANGE_WAIT_BEFORE);
+		wbDone = wbPrevIssued;
+	}
+	wbPrevIssued = wbIssued;
+	wbIssued = fileOffset;
+	dirtyBytes = 0;
+}
+
+/** Requests writeback of the current window and unmaps it. */
+void NDFileRaw::unmapWindow()
+{
+	if (pMap == NULL) return;
+
+	startWriteback();
+	pIO->unmap(pMap, mapLength);
+	pMap = NULL;
+}
+
+/** Maps the window of the output file that contains offset, preallocating the file to cover it.
+  * \param[in] offset File offset that must fall inside the new window.
+  */
+asynStatus NDFileRaw::remapWindow(off_t offset)
+{
+	static const char *functionName = "remapWindow";
+	epicsTimeStamp tStart, tEnd;
+	int err;
+
+	epicsTimeGetCurrent(&tStart);
+	unmapWindow();
+
+	mapOffset = offset - (offset % mapAlign);
+
+	// Allocate real blocks up front; a store into a hole on a full disk would raise SIGBUS instead of an error
+	err = pIO->allocate(rfile, mapOffset, mapLength);
+	if (err != 0)
+	{
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, 
+				  "%s::%s ERROR preallocating %lu bytes at offset %ld: %s\n",
+				  driverName, functionName, (unsigned long)mapLength, (long)mapOffset, strerror(err));
+		return asynError;
+	}
+
+	void *p = pIO->map(mapLength, rfile, mapOffset);
+	if (p == MAP_FAILED)
+	{
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, 
+				  "%s::%s ERROR mapping %lu bytes at offset %ld: %s\n",
+				  driverName, functionName, (unsigned long)mapLength, (long)mapOffset, strerror(errno));
+		return asynError;
+	}
+	pMap = (char *)p;
+
+	madvise(pMap, mapLength, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	// Only honoured where the filesystem supports large folios (e.g. tmpfs with huge=within_size)
+	if (hugePages) madvise(pMap, mapLength, MADV_HUGEPAGE);
+#endif
+
+	numRemaps++;
+	epicsTimeGetCurrent(&tEnd);
+	remapSeconds += epicsTimeDiffInSeconds(&tEnd, &tStart);
+
+	return asynSuccess;
+}
+
+/** Copies data into the mapped output file at the current file offset, remapping as windows fill.
+  * \param[in] pData Data to copy.
+  * \param[in] nbytes Number of bytes of data.
+  * \param[in] padded Number of bytes to advance the file offset by; the padding is left as preallocated zeroes.
+  */
+asynStatus NDFileRaw::writeMapped(const void *pData, size_t nbytes, size_t padded)
+{
+	const char *pIn = (const char *)pData;
+	size_t remaining = nbytes;
+	off_t start = fileOffset;
+
+	while (remaining > 0)
+	{
+		if ((pMap == NULL) || (fileOffset >= mapOffset + (off_t)mapLength))
+		{
+			// closeFile truncates at fileOffset, so rewinding drops the part already copied
+			if (remapWindow(fileOffset) != asynSuccess)
+			{
+				fileOffset = start;
+				return asynError;
+			}
+		}
+
+		size_t n = std::min(remaining, (size_t)(mapOffset + mapLength - fileOffset));
+		memcpy(pMap + (fileOffset - mapOffset), pIn, n);
+
+		pIn += n;
+		remaining -= n;
+		fileOffset += n;
+		dirtyBytes += n;
+
+		if (syncBytes && (dirtyBytes >= syncBytes)) startWriteback();
+	}
+
+	fileOffset += padded - nbytes;
+
+	return asynSuccess;
+}
+
+/** Read NDArray data from a HDF5 file; NOTE: not implemented yet.
+  * \param[in] pArray Pointer to the address of an NDArray to read the data into.  */ 
+asynStatus NDFileRaw::readFile(NDArray **pArray)
+{
+  //static const char *functionName = "readFile";
+  return asynError;
+}
+
+/** Closes the HDF5 file opened with NDFileRaw::openFile 
+ */ 
 asynStatus NDFileRaw::closeFile()
 {
 	epicsInt32 numCaptured;
 	static const char *functionName = "closeFile";
+	
+//	printf("In Raw File close . . . \n");
 
-	if (!this->file.is_open())
+//	if (!this->file.is_open())
+//	if (pRawFile == NULL)
+	if (rfile == -1) 
 	{
 		asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, 
 				  "%s::%s file was not open! Ignoring close command.\n", 
@@ -130,59 +937,154 @@ asynStatus NDFileRaw::closeFile()
 		return asynSuccess;
 	}
 
-	this->file.close();
+//	this->file.close();
+//	fclose(pRawFile);
+	if (outputMode == NDFileRawModeMmap)
+	{
+		// Drop the preallocated tail past the last frame
+		unmapWindow();
+		if (ftruncate(rfile, fileOffset) != 0)
+		{
+			asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, 
+					  "%s::%s ERROR truncating file to %ld bytes: %s\n",
+					  driverName, functionName, (long)fileOffset, strerror(errno));
+		}
+	}
+	close(rfile);
+	rfile = -1;
+	closeBackpressure();
 
 	asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s file closed!\n", driverName, functionName);
 
-    return asynSuccess;
+	free(alignedbuffer);
+	alignedbuffer = NULL;
+	alignedsize = 0;
+	
+
+//printf("file closed, buffer freed \n");
+
+	return asynSuccess;
+}
+
+/** Selects the file I/O used for the primary and spill files.  Must not be called while a file is open.
+  * \param[in] pIO Table of I/O functions, or NULL for NDFileRawSystemIO.
+  */
+void NDFileRaw::setIO(const NDFileRawIO_t *pIO)
+{
+	this->pIO = pIO ? pIO : &NDFileRawSystemIO;
 }
 
 
-/** Constructor for NDFileRaw; all parameters are simply passed to NDPluginFile::NDPluginFile.
-  * \param[in] portName The name of the asyn port driver to be created.
-  * \param[in] queueSize The number of NDArrays that the input queue for this plugin can hold when 
-  *            NDPluginDriverBlockingCallbacks=0.  Larger queues can decrease the number of dropped arrays,
-  *            at the expense of more NDArray buffers being allocated from the underlying driver's NDArrayPool.
-  * \param[in] blockingCallbacks Initial setting for the NDPluginDriverBlockingCallbacks flag.
-  *            0=callbacks are queued and executed by the callback thread; 1 callbacks execute in the thread
-  *            of the driver doing the callbacks.
-  * \param[in] NDArrayPort Name of asyn port driver for initial source of NDArray callbacks.
-  * \param[in] NDArrayAddr asyn port driver address for initial source of NDArray callbacks.
-  * \param[in] priority The thread priority for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
-  * \param[in] stackSize The stack size for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
+/** Constructor for NDFileHDF5; parameters are identical to those for NDPluginFile::NDPluginFile,
+    and are passed directly to that base class constructor.
+  * After calling the base class constructor this method sets NDPluginFile::supportsMultipleArrays=1.
   */
-NDFileRaw::NDFileRaw(const char *portName, int queueSize, int blockingCallbacks,
-                       const char *NDArrayPort, int NDArrayAddr,
-                       int priority, int stackSize)
-    /* Invoke the base class constructor.
-     * We allocate 2 NDArrays of unlimited size in the NDArray pool.
-     * This driver can block (because writing a file can be slow), and it is not multi-device.  
-     * Set autoconnect to 1.  priority and stacksize can be 0, which will use defaults. */
-    : NDPluginFile(portName, queueSize, blockingCallbacks,
-                   NDArrayPort, NDArrayAddr, 1,
-                   2, 0, asynGenericPointerMask, asynGenericPointerMask, 
-                   ASYN_CANBLOCK, 1, priority, stackSize, 1)
+NDFileRaw::NDFileRaw(const char *portName, int queueSize, int blockingCallbacks, 
+                     const char *NDArrayPort, int NDArrayAddr,
+                     int priority, int stackSize)
+  /* Invoke the base class constructor.
+   * We allocate 2 NDArrays of unlimited size in the NDArray pool.
+   * This driver can block (because writing a file can be slow), and it is not multi-device.  
+   * Set autoconnect to 1.  priority and stacksize can be 0, which will use defaults. */
+  : NDPluginFile(portName, queueSize, blockingCallbacks,
+                 NDArrayPort, NDArrayAddr, 1, 
+				 2, 0, asynGenericPointerMask, 
+				 asynGenericPointerMask, ASYN_CANBLOCK, 1, 
+				 priority, stackSize,1)
 {
-    //static const char *functionName = "NDFileRaw";
+  //static const char *functionName = "NDFileRaw";
+   setStringParam(NDPluginDriverPluginType, "NDFileRaw");
+   
+   this->supportsMultipleArrays = 1;
+   
+   this->pAttributeId = NULL;
+   this->pFileAttributes = new NDAttributeList;
+
+   this->rfile = -1;
+   this->pIO = &NDFileRawSystemIO;
+   this->alignedbuffer = NULL;
+   this->alignedsize = 0;
+   this->pMap = NULL;
+   this->outputMode = NDFileRawModeDirect;
+   this->bpMutex = epicsMutexMustCreate();
+   this->bpWatchdogEvent = epicsEventMustCreate(epicsEventEmpty);
+   this->bpActive = 0;
+   this->bpPolicy = NDFileRawBPOff;
+   this->bpLatencyLimit = 0.;
+   this->bpQueueLimit = 0;
+   this->bpQueueUse = 0;
+   this->bpWriting = 0;
+   this->bpBehind = 0;
+   this->bpLatency = 0.;
+   this->spillFile = -1;
+   this->bpLog = NULL;
+
+   createParam(NDFileRawOutputModeString,       asynParamInt32,   &NDFileRawOutputMode);
+   createParam(NDFileRawMmapWindowString,       asynParamInt32,   &NDFileRawMmapWindow);
+   createParam(NDFileRawMmapSyncIntervalString, asynParamInt32,   &NDFileRawMmapSyncInterval);
+   createParam(NDFileRawMmapHugePagesString,    asynParamInt32,   &NDFileRawMmapHugePages);
+   createParam(NDFileRawMmapRemapsString,       asynParamInt32,   &NDFileRawMmapRemaps);
+   createParam(NDFileRawMmapRemapTimeString,    asynParamFloat64, &NDFileRawMmapRemapTime);
+   createParam(NDFileRawMmapWritebackLagString, asynParamFloat64, &NDFileRawMmapWritebackLag);
+   createParam(NDFileRawWriteTimeString,        asynParamFloat64, &NDFileRawWriteTime);
+   createParam(NDFileRawWriteRateString,        asynParamFloat64, &NDFileRawWriteRate);
+   createParam(NDFileRawBPPolicyString,         asynParamInt32,   &NDFileRawBPPolicy);
+   createParam(NDFileRawBPLatencyLimitString,   asynParamFloat64, &NDFileRawBPLatencyLimit);
+   createParam(NDFileRawBPQueueLimitString,     asynParamInt32,   &NDFileRawBPQueueLimit);
+   createParam(NDFileRawBPDecimationString,     asynParamInt32,   &NDFileRawBPDecimation);
+   createParam(NDFileRawBPSpillPathString,      asynParamOctet,   &NDFileRawBPSpillPath);
+   createParam(NDFileRawBPProbeIntervalString,  asynParamInt32,   &NDFileRawBPProbeInterval);
+   createParam(NDFileRawBPSlowDownString,       asynParamInt32,   &NDFileRawBPSlowDown);
+   createParam(NDFileRawBPLatencyString,        asynParamFloat64, &NDFileRawBPLatency);
+   createParam(NDFileRawBPQueueUseString,       asynParamInt32,   &NDFileRawBPQueueUse);
+   createParam(NDFileRawBPSkippedString,        asynParamInt32,   &NDFileRawBPSkipped);
+   createParam(NDFileRawBPSpilledString,        asynParamInt32,   &NDFileRawBPSpilled);
+
+   setIntegerParam(NDFileRawOutputMode, NDFileRawModeDirect);
+   setIntegerParam(NDFileRawMmapWindow, 256);
+   setIntegerParam(NDFileRawMmapSyncInterval, 64);
+   setIntegerParam(NDFileRawMmapHugePages, 0);
+   setIntegerParam(NDFileRawBPPolicy, NDFileRawBPOff);
+   setDoubleParam(NDFileRawBPLatencyLimit, 100.);
+   setIntegerParam(NDFileRawBPQueueLimit, 80);
+   setIntegerParam(NDFileRawBPDecimation, 2);
+   setStringParam(NDFileRawBPSpillPath, "");
+   setIntegerParam(NDFileRawBPProbeInterval, 10);
+   setIntegerParam(NDFileRawBPSlowDown, 0);
+
+   /* NDPluginFile releases the port lock around writeFile, so the watchdog can still take it
+    * while the writer is blocked in write() */
+   if (epicsThreadCreate("NDFileRawWatchdog", epicsThreadPriorityMedium,
+                         epicsThreadGetStackSize(epicsThreadStackMedium),
+                         (EPICSTHREADFUNC)bpWatchdogC, this) == NULL) {
+       printf("%s::NDFileRaw epicsThreadCreate failure for watchdog thread\n", driverName);
+   }
+
+
+ //  posix_memalign(&nullbuffer, size, size);
+//printf("Null Buffer created and aligned\n");
 
-    /* Set the plugin type string */    
-    setStringParam(NDPluginDriverPluginType, "NDFileRaw");
-    this->supportsMultipleArrays = 0;
 }
 
-/* Configuration routine.  Called directly, or from the iocsh  */
 
-extern "C" int NDFileRawConfigure(const char *portName, int queueSize, int blockingCallbacks,
-                                   const char *NDArrayPort, int NDArrayAddr,
-                                   int priority, int stackSize)
+
+/** Configuration routine.  Called directly, or from the iocsh function in NDFileEpics */
+extern "C" int NDFileRawConfigure(const char *portName, int queueSize, int blockingCallbacks, 
+                                  const char *NDArrayPort, int NDArrayAddr,
+                                  int priority, int stackSize)
 {
+ // new NDFileRaw(portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr, priority, stackSize);
+  
+//  return(asynSuccess);
+
     NDFileRaw *pPlugin = new NDFileRaw(portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr,
                                          priority, stackSize);
     return pPlugin->start();
+
 }
 
-/* EPICS iocsh shell commands */
 
+/** EPICS iocsh shell commands */
 static const iocshArg initArg0 = { "portName",iocshArgString};
 static const iocshArg initArg1 = { "frame queue size",iocshArgInt};
 static const iocshArg initArg2 = { "blocking callbacks",iocshArgInt};
@@ -200,14 +1102,16 @@ static const iocshArg * const initArgs[] = {&initArg0,
 static const iocshFuncDef initFuncDef = {"NDFileRawConfigure",7,initArgs};
 static void initCallFunc(const iocshArgBuf *args)
 {
-    NDFileRawConfigure(args[0].sval, args[1].ival, args[2].ival, args[3].sval, args[4].ival, args[5].ival, args[6].ival);
+  NDFileRawConfigure(args[0].sval, args[1].ival, args[2].ival, args[3].sval, 
+                      args[4].ival, args[5].ival, args[6].ival);
 }
 
 extern "C" void NDFileRawRegister(void)
 {
-    iocshRegister(&initFuncDef,initCallFunc);
+  iocshRegister(&initFuncDef,initCallFunc);
 }
 
 extern "C" {
 epicsExportRegistrar(NDFileRawRegister);
 }
+
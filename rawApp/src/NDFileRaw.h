@@ -1,35 +1,169 @@
-/*
- * NDFileRaw.h
+/* NDFileRaw.h
+ * Writes NDArrays to raw files.
+ *
+ * Keenan Lang
+ * October 5th, 2016
  */
 
-#ifndef DRV_NDFileNULL_H
-#define DRV_NDFileNULL_H
-
+#ifndef DRV_NDFileRaw_H
+#define DRV_NDFileRaw_H
 
 #include <fstream>
+#include <sys/types.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsTime.h>
 #include <asynDriver.h>
 #include <NDPluginFile.h>
 #include <NDArray.h>
 
-/** Writes NDArrays in the Raw file format. */
+/* File I/O used by the writer.  NDFileRawSystemIO calls the system directly; setIO substitutes
+ * another table, e.g. one that injects faults in the tests. */
+typedef struct {
+    ssize_t (*write)(int fd, const void *pData, size_t nbytes);                /* write() */
+    int     (*allocate)(int fd, off_t offset, off_t length);                    /* posix_fallocate(), returns an errno */
+    void   *(*map)(size_t length, int fd, off_t offset);                        /* Shared read/write mmap() */
+    int     (*unmap)(void *pMap, size_t length);                                /* munmap() */
+    int     (*syncRange)(int fd, off_t offset, off_t nbytes, unsigned int flags); /* sync_file_range() */
+} NDFileRawIO_t;
+
+extern const NDFileRawIO_t NDFileRawSystemIO;
+
+/* Output modes for NDFileRawOutputMode */
+typedef enum {
+    NDFileRawModeDirect,    /* O_DIRECT write() of alignedbuffer */
+    NDFileRawModeMmap       /* memcpy into sliding mmap windows of the output file */
+} NDFileRawOutputMode_t;
 
-class epicsShareClass NDFileRaw : public NDPluginFile {
-public:
-    NDFileRaw(const char *portName, int queueSize, int blockingCallbacks,
-                 const char *NDArrayPort, int NDArrayAddr,
-                 int priority, int stackSize);
+#define NDFileRawOutputModeString        "RAW_OUTPUT_MODE"         /* (asynInt32,   r/w) Direct or Mmap */
+#define NDFileRawMmapWindowString        "RAW_MMAP_WINDOW"         /* (asynInt32,   r/w) Window size in MB */
+#define NDFileRawMmapSyncIntervalString  "RAW_MMAP_SYNC_INTERVAL"  /* (asynInt32,   r/w) MB copied between writeback requests, 0=only on remap */
+#define NDFileRawMmapHugePagesString     "RAW_MMAP_HUGE_PAGES"     /* (asynInt32,   r/w) madvise(MADV_HUGEPAGE) on each window */
+#define NDFileRawMmapRemapsString        "RAW_MMAP_REMAPS"         /* (asynInt32,   r/o) Windows mapped since open */
+#define NDFileRawMmapRemapTimeString     "RAW_MMAP_REMAP_TIME"     /* (asynFloat64, r/o) Mean cost of one remap in ms */
+#define NDFileRawMmapWritebackLagString  "RAW_MMAP_WRITEBACK_LAG"  /* (asynFloat64, r/o) MB copied but not yet confirmed written back */
+#define NDFileRawWriteTimeString         "RAW_WRITE_TIME"          /* (asynFloat64, r/o) Time to write last frame in ms */
+#define NDFileRawWriteRateString         "RAW_WRITE_RATE"          /* (asynFloat64, r/o) Mean rate since open in MB/s */
 
+/* Policies for NDFileRawBPPolicy, applied while the writer is behind */
+typedef enum {
+    NDFileRawBPOff,         /* No action, frames queue and are dropped by NDPluginDriver */
+    NDFileRawBPSignal,      /* Only assert NDFileRawBPSlowDown */
+    NDFileRawBPDecimate,    /* Write every Nth frame */
+    NDFileRawBPSpill        /* Write frames to a file in NDFileRawBPSpillPath, probing the primary file every Nth */
+} NDFileRawBPPolicy_t;
+
+#define NDFileRawBPPolicyString          "RAW_BP_POLICY"           /* (asynInt32,   r/w) Off, Signal, Decimate or Spill */
+#define NDFileRawBPLatencyLimitString    "RAW_BP_LATENCY_LIMIT"    /* (asynFloat64, r/w) Smoothed write time in ms above which we are behind */
+#define NDFileRawBPQueueLimitString      "RAW_BP_QUEUE_LIMIT"      /* (asynInt32,   r/w) Queue use in % above which we are behind */
+#define NDFileRawBPDecimationString      "RAW_BP_DECIMATION"       /* (asynInt32,   r/w) N for the Decimate policy */
+#define NDFileRawBPSpillPathString       "RAW_BP_SPILL_PATH"       /* (asynOctet,   r/w) Directory for the Spill policy */
+#define NDFileRawBPProbeIntervalString   "RAW_BP_PROBE_INTERVAL"   /* (asynInt32,   r/w) N for the Spill policy's probe writes */
+#define NDFileRawBPSlowDownString        "RAW_BP_SLOW_DOWN"        /* (asynInt32,   r/o) 1 while the writer is behind */
+#define NDFileRawBPLatencyString         "RAW_BP_LATENCY"          /* (asynFloat64, r/o) Smoothed write time in ms, measured writes only */
+#define NDFileRawBPQueueUseString        "RAW_BP_QUEUE_USE"        /* (asynInt32,   r/o) Queue use in % */
+#define NDFileRawBPSkippedString         "RAW_BP_SKIPPED"          /* (asynInt32,   r/o) Frames not written by Decimate since open */
+#define NDFileRawBPSpilledString         "RAW_BP_SPILLED"          /* (asynInt32,   r/o) Frames written to the spill file since open */
+
+class epicsShareClass NDFileRaw : public NDPluginFile
+{
+  public:
+    NDFileRaw(const char *portName, int queueSize, int blockingCallbacks, 
+               const char *NDArrayPort, int NDArrayAddr,
+               int priority, int stackSize);
+       
     /* The methods that this class implements */
     virtual asynStatus openFile(const char *fileName, NDFileOpenMode_t openMode, NDArray *pArray);
     virtual asynStatus readFile(NDArray **pArray);
     virtual asynStatus writeFile(NDArray *pArray);
     virtual asynStatus closeFile();
+
+    void setIO(const NDFileRawIO_t *pIO);
+
+    /* This should be private but is called from C so must be public */
+    void bpWatchdog();
 	
-	  protected:
+  protected:
     /* plugin parameters */
+    int NDFileRawOutputMode;
+    #define FIRST_NDFILE_RAW_PARAM NDFileRawOutputMode
+    int NDFileRawMmapWindow;
+    int NDFileRawMmapSyncInterval;
+    int NDFileRawMmapHugePages;
+    int NDFileRawMmapRemaps;
+    int NDFileRawMmapRemapTime;
+    int NDFileRawMmapWritebackLag;
+    int NDFileRawWriteTime;
+    int NDFileRawWriteRate;
+    int NDFileRawBPPolicy;
+    int NDFileRawBPLatencyLimit;
+    int NDFileRawBPQueueLimit;
+    int NDFileRawBPDecimation;
+    int NDFileRawBPSpillPath;
+    int NDFileRawBPProbeInterval;
+    int NDFileRawBPSlowDown;
+    int NDFileRawBPLatency;
+    int NDFileRawBPQueueUse;
+    int NDFileRawBPSkipped;
+    int NDFileRawBPSpilled;
 
   private:
-	std::ofstream file;
+//	std::ofstream file;
+//	FILE* pRawFile;
+	int rfile;
+	const NDFileRawIO_t *pIO;
+	void *alignedbuffer;
+	size_t alignedsize;
+	asynStatus writeDirect(const void *pData, size_t nbytes);
+	    int *pAttributeId;
+    NDAttributeList *pFileAttributes;
+
+    /* Mmap output mode state */
+    asynStatus writeMapped(const void *pData, size_t nbytes, size_t padded);
+    asynStatus remapWindow(off_t offset);
+    void startWriteback();
+    void unmapWindow();
+    int outputMode;
+    char *pMap;
+    off_t mapOffset;
+    size_t mapLength;
+    size_t mapAlign;
+    off_t fileOffset;
+    size_t dirtyBytes;      /* Copied since the last writeback request */
+    off_t wbIssued;         /* Writeback requested up to here */
+    off_t wbPrevIssued;     /* End of the request before that */
+    off_t wbDone;           /* Writeback confirmed up to here */
+    size_t syncBytes;
+    int hugePages;
+    int numRemaps;
+    double remapSeconds;
+    double writeSeconds;
+    double bytesWritten;
+
+    /* Backpressure state */
+    asynStatus openBackpressure(const char *fileName, const void *pHeader, size_t headerSize);
+    int backpressureAction(NDArray *pArray);
+    void logDecision(int uniqueId, const char *decision, double latency);
+    asynStatus writeSpill(NDArray *pArray);
+    void closeBackpressure();
+    epicsEventId bpWatchdogEvent;   /* Wakes the watchdog when monitoring starts */
+    epicsMutexId bpMutex;   /* Shared with the watchdog thread: bpActive to bpLog */
+    int bpActive;
+    int bpPolicy;
+    double bpLatencyLimit;
+    int bpQueueLimit;
+    int bpQueueUse;
+    int bpWriting;
+    int bpWritingId;
+    epicsTimeStamp bpWriteStart;
+    int bpBehind;
+    int bpBehindFrames;
+    int bpSkipped;
+    int bpSpilled;
+    double bpLatency;
+    FILE *bpLog;
+    int spillFile;
+
 };
-#define NUM_NDFILE_RAW_PARAMS 0
+
 #endif
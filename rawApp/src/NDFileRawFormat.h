@@ -0,0 +1,47 @@
+/* NDFileRawFormat.h
+ * On-disk layout of files written by NDFileRaw, shared by the plugin and the offline converter.
+ *
+ * A file is one 512 byte fullheader describing the first array, followed by the frames.
+ * Each frame is the raw pArray->dataSize bytes of the NDArray, padded with zeroes to a
+ * multiple of 512 bytes so it can be written with O_DIRECT.
+ */
+
+#ifndef NDFileRawFormat_H
+#define NDFileRawFormat_H
+
+#include <epicsTime.h>
+
+#define NDFILE_RAW_ALIGN  512
+
+struct fullheader{
+int datatype;
+int ndims;
+int dims0size;
+int dims1size;
+int dims0offset;
+int dims1offset;
+int dims0binning;
+int dims1binning;
+int dims0reverse;
+int dims1reverse;
+int constant1;
+int constant2;
+int constant3;
+int constant4;
+int constant5;
+int constant6;
+int uniqueid;
+int datasize;
+double timestamp;
+epicsTimeStamp epicsts;
+int flat;
+int dark;
+int filler[104];
+};
+
+/* Rounds numToRound up to a multiple of multiple, which must be a power of 2 */
+inline int roundUp(int numToRound, int multiple) { 
+return (numToRound + multiple - 1) & -multiple; 
+}
+
+#endif
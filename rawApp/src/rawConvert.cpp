@@ -0,0 +1,622 @@
+/* rawConvert.cpp
+ * Offline converter from NDFileRaw captures to HDF5 or TIFF.
+ *
+ * Frames are read, cropped and (for compressed HDF5) deflated by a pool of worker threads and
+ * handed back to the main thread, which only appends them in frame order.  TIFF frames are
+ * independent files, so the workers write them directly.  HDF5 output is a
+ * single chunked (optionally deflate compressed) dataset /entry/data/data of [frames, rows,
+ * columns], one chunk per frame, so workers can compress whole chunks.  TIFF output is
+ * a directory holding one file per frame, named after the frame number in the raw file.
+ *
+ * Usage: rawConvert [-f hdf5|tiff] [-r first:last] [-R x,y,width,height] [-z level]
+ *                   [-t threads] [-c] input.raw output
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <map>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsMessageQueue.h>
+#include <epicsEvent.h>
+#include <epicsTime.h>
+#include <epicsStdio.h>
+#include <NDArray.h>
+
+#include <zlib.h>
+
+#ifdef HAVE_HDF5
+#include <hdf5.h>
+#if !H5_VERSION_GE(1,10,3)
+#include <hdf5_hl.h>
+#define H5Dwrite_chunk H5DOwrite_chunk
+#endif
+#endif
+#ifdef HAVE_TIFF
+#include <tiffio.h>
+#endif
+
+#include "NDFileRawFormat.h"
+
+static const char *programName = "rawConvert";
+
+typedef enum {
+    formatHDF5,
+    formatTIFF
+} rawConvertFormat_t;
+
+/* A frame in flight between a worker and the writer; pData is NULL if the read failed.
+ * When compressing, the deflated chunk is at pData + bufferSize and is compressedSize long. */
+typedef struct {
+    long frame;
+    char *pData;
+    size_t compressedSize;
+    int written;            /* Already written by the worker, and pData returned to the free queue */
+} rawConvertJob_t;
+
+typedef struct {
+    int fd;
+    size_t elementSize;
+    size_t columns;         /* Full frame dimensions */
+    size_t rows;
+    size_t frameStride;     /* Bytes from one frame to the next in the raw file */
+    size_t roiX, roiY, roiWidth, roiHeight;
+    size_t bufferSize;      /* Bytes of each buffer holding the uncompressed rows */
+    int level;              /* Deflate level, 0 for none */
+    const char *tiffDir;    /* Workers write each frame here as a TIFF, NULL for HDF5 */
+    int dataType;
+    long nextFrame;
+    long lastFrame;
+    epicsMutex *pLock;
+    epicsMessageQueue *pFreeQueue;
+    epicsMessageQueue *pDoneQueue;
+    int numWorkers;         /* Workers still running; the last one to exit signals doneEvent */
+    epicsEventId doneEvent;
+} rawConvertPipeline_t;
+
+static size_t elementSize(int dataType)
+{
+    switch (dataType) {
+        case NDInt8:
+        case NDUInt8:   return 1;
+        case NDInt16:
+        case NDUInt16:  return 2;
+        case NDInt32:
+        case NDUInt32:
+        case NDFloat32: return 4;
+        case NDInt64:
+        case NDUInt64:
+        case NDFloat64: return 8;
+        default:        return 0;
+    }
+}
+
+/** Reads the rows of one frame that intersect the ROI and crops them in place to the ROI.
+  * \return 0 on success, -1 on a read error with errno set, or -2 if the file ends early. */
+static int readFrame(rawConvertPipeline_t *p, long frame, char *pBuf)
+{
+    size_t rowBytes = p->columns * p->elementSize;
+    size_t roiRowBytes = p->roiWidth * p->elementSize;
+    size_t nbytes = p->roiHeight * rowBytes;
+    off_t offset = NDFILE_RAW_ALIGN + (off_t)frame*p->frameStride + (off_t)p->roiY*rowBytes;
+    size_t done = 0;
+
+    while (done < nbytes) {
+        ssize_t n = pread(p->fd, pBuf + done, nbytes - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) return -2;
+        done += n;
+    }
+
+    if (roiRowBytes != rowBytes) {
+        for (size_t row=0; row<p->roiHeight; row++) {
+            memmove(pBuf + row*roiRowBytes, pBuf + row*rowBytes + p->roiX*p->elementSize, roiRowBytes);
+        }
+    }
+    return 0;
+}
+
+#ifdef HAVE_TIFF
+static int writeTIFF(const char *dirName, long frame, int dataType, const char *pData,
+                     size_t roiWidth, size_t roiHeight, size_t elemSize);
+#endif
+
+/** Worker thread: claims the next frame number, reads and crops it, and queues it for the writer,
+  * or for TIFF output writes it and only reports it to the writer.
+  * A buffer is taken from the free queue before a frame is claimed, so the lowest frame in flight
+  * always has a buffer and the writer can never deadlock waiting for it. */
+static void workerTask(void *drvPvt)
+{
+    rawConvertPipeline_t *p = (rawConvertPipeline_t *)drvPvt;
+    rawConvertJob_t job;
+    char *pBuf;
+
+    while (1) {
+        p->pFreeQueue->receive(&pBuf, sizeof(pBuf));
+        p->pLock->lock();
+        job.frame = p->nextFrame++;
+        p->pLock->unlock();
+        if (job.frame > p->lastFrame) {
+            p->pFreeQueue->send(&pBuf, sizeof(pBuf));
+            break;
+        }
+        job.pData = pBuf;
+        job.compressedSize = 0;
+        job.written = 0;
+        int status = readFrame(p, job.frame, pBuf);
+        if (status == -1) {
+            fprintf(stderr, "%s: error reading frame %ld: %s\n", programName, job.frame, strerror(errno));
+        } else if (status == -2) {
+            fprintf(stderr, "%s: input is truncated in frame %ld\n", programName, job.frame);
+        } else if (p->level > 0) {
+            uLongf destLen = compressBound(p->roiWidth * p->roiHeight * p->elementSize);
+            if (compress2((Bytef *)pBuf + p->bufferSize, &destLen, (const Bytef *)pBuf,
+                          p->roiWidth * p->roiHeight * p->elementSize, p->level) != Z_OK) {
+                fprintf(stderr, "%s: error compressing frame %ld\n", programName, job.frame);
+                status = -1;
+            }
+            job.compressedSize = destLen;
+        }
+#ifdef HAVE_TIFF
+        if ((status == 0) && p->tiffDir) {
+            if (writeTIFF(p->tiffDir, job.frame, p->dataType, pBuf, p->roiWidth, p->roiHeight, p->elementSize)) {
+                fprintf(stderr, "%s: error writing frame %ld\n", programName, job.frame);
+                status = -1;
+            }
+            job.written = 1;
+        }
+#endif
+        if (status || job.written) {
+            if (status) job.pData = NULL;
+            p->pFreeQueue->send(&pBuf, sizeof(pBuf));
+        }
+        p->pDoneQueue->send(&job, sizeof(job));
+    }
+    // main returns as soon as doneEvent is signalled, so p must not be touched after that
+    p->pLock->lock();
+    int last = (--p->numWorkers == 0);
+    p->pLock->unlock();
+    if (last) epicsEventSignal(p->doneEvent);
+}
+
+#ifdef HAVE_HDF5
+typedef struct {
+    hid_t file;
+    hid_t dataset;
+    hid_t dataType;
+    hsize_t numWritten;
+} rawConvertHDF5_t;
+
+static hid_t hdf5Type(int dataType)
+{
+    switch (dataType) {
+        case NDInt8:    return H5T_NATIVE_INT8;
+        case NDUInt8:   return H5T_NATIVE_UINT8;
+        case NDInt16:   return H5T_NATIVE_INT16;
+        case NDUInt16:  return H5T_NATIVE_UINT16;
+        case NDInt32:   return H5T_NATIVE_INT32;
+        case NDUInt32:  return H5T_NATIVE_UINT32;
+        case NDInt64:   return H5T_NATIVE_INT64;
+        case NDUInt64:  return H5T_NATIVE_UINT64;
+        case NDFloat32: return H5T_NATIVE_FLOAT;
+        default:        return H5T_NATIVE_DOUBLE;
+    }
+}
+
+/** Opens the HDF5 output.  When resuming, the frames already in the dataset are counted in
+  * numWritten, the dataset must have been created with the same first frame and ROI, and
+  * *pLevel is replaced by the deflate level the dataset was created with. */
+static int openHDF5(rawConvertHDF5_t *h, const char *fileName, int dataType, long firstFrame,
+                    size_t roiWidth, size_t roiHeight, const long roi[4], int *pLevel, int resume)
+{
+    hsize_t dims[3] = {0, roiHeight, roiWidth};
+    hsize_t maxDims[3] = {H5S_UNLIMITED, roiHeight, roiWidth};
+    hsize_t chunk[3] = {1, roiHeight, roiWidth};
+    hsize_t attrDims = 4;
+    long storedFirst, storedRoi[4];
+
+    h->dataType = hdf5Type(dataType);
+    h->numWritten = 0;
+
+    if (resume && (access(fileName, F_OK) == 0)) {
+        h->file = H5Fopen(fileName, H5F_ACC_RDWR, H5P_DEFAULT);
+        if (h->file < 0) return -1;
+        h->dataset = H5Dopen2(h->file, "/entry/data/data", H5P_DEFAULT);
+        if (h->dataset < 0) return -1;
+        herr_t status = -1;
+        hid_t attr = H5Aopen(h->dataset, "first_frame", H5P_DEFAULT);
+        if (attr >= 0) {
+            status = H5Aread(attr, H5T_NATIVE_LONG, &storedFirst);
+            H5Aclose(attr);
+        }
+        if (status >= 0) {
+            status = -1;
+            attr = H5Aopen(h->dataset, "roi", H5P_DEFAULT);
+            if (attr >= 0) {
+                status = H5Aread(attr, H5T_NATIVE_LONG, storedRoi);
+                H5Aclose(attr);
+            }
+        }
+        if (status < 0) {
+            fprintf(stderr, "%s: %s has no first_frame/roi attributes, cannot resume\n",
+                    programName, fileName);
+            return -1;
+        }
+        if ((storedFirst != firstFrame) || memcmp(storedRoi, roi, sizeof(storedRoi))) {
+            fprintf(stderr, "%s: %s was started with a different frame range or ROI, cannot resume\n",
+                    programName, fileName);
+            return -1;
+        }
+        hid_t space = H5Dget_space(h->dataset);
+        H5Sget_simple_extent_dims(space, dims, NULL);
+        H5Sclose(space);
+        h->numWritten = dims[0];
+
+        /* Chunks are compressed by the workers, so they must match the dataset's filter */
+        unsigned int flags, cdValues[1] = {0};
+        size_t numValues = 1;
+        hid_t plist = H5Dget_create_plist(h->dataset);
+        if (H5Pget_filter_by_id2(plist, H5Z_FILTER_DEFLATE, &flags, &numValues, cdValues, 0, NULL, NULL) >= 0) {
+            *pLevel = cdValues[0] ? cdValues[0] : 1;
+        } else {
+            *pLevel = 0;
+        }
+        H5Pclose(plist);
+        return 0;
+    }
+
+    h->file = H5Fcreate(fileName, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (h->file < 0) return -1;
+    H5Gclose(H5Gcreate2(h->file, "/entry", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT));
+    H5Gclose(H5Gcreate2(h->file, "/entry/data", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT));
+
+    hid_t space = H5Screate_simple(3, dims, maxDims);
+    hid_t plist = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(plist, 3, chunk);
+    if (*pLevel > 0) H5Pset_deflate(plist, *pLevel);
+    h->dataset = H5Dcreate2(h->file, "/entry/data/data", h->dataType, space, H5P_DEFAULT, plist, H5P_DEFAULT);
+    H5Pclose(plist);
+    H5Sclose(space);
+    if (h->dataset < 0) return -1;
+
+    space = H5Screate(H5S_SCALAR);
+    hid_t attr = H5Acreate2(h->dataset, "first_frame", H5T_NATIVE_LONG, space, H5P_DEFAULT, H5P_DEFAULT);
+    H5Awrite(attr, H5T_NATIVE_LONG, &firstFrame);
+    H5Aclose(attr);
+    H5Sclose(space);
+    space = H5Screate_simple(1, &attrDims, NULL);
+    attr = H5Acreate2(h->dataset, "roi", H5T_NATIVE_LONG, space, H5P_DEFAULT, H5P_DEFAULT);
+    H5Awrite(attr, H5T_NATIVE_LONG, roi);
+    H5Aclose(attr);
+    H5Sclose(space);
+    return 0;
+}
+
+/** Appends one frame to the dataset.  A frame deflated by a worker (compressedSize > 0) is written
+  * as a raw chunk, so no compression happens on this thread. */
+static int writeHDF5(rawConvertHDF5_t *h, const char *pData, size_t compressedSize,
+                     size_t roiWidth, size_t roiHeight)
+{
+    hsize_t dims[3] = {h->numWritten + 1, roiHeight, roiWidth};
+    hsize_t start[3] = {h->numWritten, 0, 0};
+    hsize_t count[3] = {1, roiHeight, roiWidth};
+    herr_t status;
+
+    if (H5Dset_extent(h->dataset, dims) < 0) return -1;
+    if (compressedSize > 0) {
+        status = H5Dwrite_chunk(h->dataset, H5P_DEFAULT, 0, start, compressedSize, pData);
+        if (status < 0) return -1;
+        h->numWritten++;
+        if ((h->numWritten % 64) == 0) H5Fflush(h->file, H5F_SCOPE_LOCAL);
+        return 0;
+    }
+    hid_t fileSpace = H5Dget_space(h->dataset);
+    H5Sselect_hyperslab(fileSpace, H5S_SELECT_SET, start, NULL, count, NULL);
+    hid_t memSpace = H5Screate_simple(3, count, NULL);
+    status = H5Dwrite(h->dataset, h->dataType, memSpace, fileSpace, H5P_DEFAULT, pData);
+    H5Sclose(memSpace);
+    H5Sclose(fileSpace);
+    if (status < 0) return -1;
+    h->numWritten++;
+    /* Keep the extent on disk current so an interrupted conversion can be resumed */
+    if ((h->numWritten % 64) == 0) H5Fflush(h->file, H5F_SCOPE_LOCAL);
+    return 0;
+}
+
+static void closeHDF5(rawConvertHDF5_t *h)
+{
+    H5Dclose(h->dataset);
+    H5Fclose(h->file);
+}
+#endif
+
+#ifdef HAVE_TIFF
+/** Writes one frame as a single strip TIFF.  The file is written under a temporary name and
+  * renamed, so any frame file that exists is complete. */
+static int writeTIFF(const char *dirName, long frame, int dataType, const char *pData,
+                     size_t roiWidth, size_t roiHeight, size_t elemSize)
+{
+    char fileName[1024], tempName[1040];
+    int sampleFormat;
+
+    switch (dataType) {
+        case NDInt8: case NDInt16: case NDInt32: case NDInt64:
+            sampleFormat = SAMPLEFORMAT_INT;      break;
+        case NDFloat32: case NDFloat64:
+            sampleFormat = SAMPLEFORMAT_IEEEFP;   break;
+        default:
+            sampleFormat = SAMPLEFORMAT_UINT;     break;
+    }
+
+    epicsSnprintf(fileName, sizeof(fileName), "%s/frame_%06ld.tif", dirName, frame);
+    epicsSnprintf(tempName, sizeof(tempName), "%s.tmp", fileName);
+    TIFF *tiff = TIFFOpen(tempName, "w");
+    if (tiff == NULL) return -1;
+    TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, (uint32_t)roiWidth);
+    TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, (uint32_t)roiHeight);
+    TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, (uint16_t)(elemSize*8));
+    TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 1);
+    TIFFSetField(tiff, TIFFTAG_SAMPLEFORMAT, sampleFormat);
+    TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, (uint32_t)roiHeight);
+    tsize_t status = TIFFWriteEncodedStrip(tiff, 0, (tdata_t)pData, roiWidth*roiHeight*elemSize);
+    TIFFClose(tiff);
+    if (status < 0) return -1;
+    return rename(tempName, fileName);
+}
+
+/** Returns the first frame in [first, last] that has no TIFF file yet. */
+static long firstMissingTIFF(const char *dirName, long first, long last)
+{
+    char fileName[1024];
+    long frame;
+
+    for (frame=first; frame<=last; frame++) {
+        epicsSnprintf(fileName, sizeof(fileName), "%s/frame_%06ld.tif", dirName, frame);
+        if (access(fileName, F_OK) != 0) break;
+    }
+    return frame;
+}
+#endif
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: %s [options] input.raw output\n"
+        "  -f hdf5|tiff        Output format; default is hdf5 for .h5/.hdf5 outputs, otherwise tiff\n"
+        "                      (output is then a directory of frame_NNNNNN.tif files)\n"
+        "  -r first:last       Frame range to convert, inclusive; default is all frames\n"
+        "  -R x,y,width,height Region of interest; default is the full frame\n"
+        "  -z level            Deflate compression level 0-9 for HDF5; default 0 (none)\n"
+        "  -t threads          Number of read/transform threads; default 4\n"
+        "  -c                  Continue an interrupted conversion into the same output\n",
+        programName);
+}
+
+int main(int argc, char *argv[])
+{
+    rawConvertPipeline_t p;
+    struct fullheader header;
+    struct stat statBuf;
+    rawConvertFormat_t format;
+    const char *formatName = NULL;
+    const char *inputName, *outputName;
+    long firstFrame = 0, lastFrame = -1, numFrames;
+    long roi[4] = {0, 0, 0, 0};
+    int level = 0, numThreads = 4, resume = 0, haveRoi = 0;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "f:r:R:z:t:ch")) != -1) {
+        switch (opt) {
+            case 'f': formatName = optarg; break;
+            case 'r':
+                if (sscanf(optarg, "%ld:%ld", &firstFrame, &lastFrame) != 2) { usage(); return 1; }
+                break;
+            case 'R':
+                if (sscanf(optarg, "%ld,%ld,%ld,%ld", &roi[0], &roi[1], &roi[2], &roi[3]) != 4) { usage(); return 1; }
+                haveRoi = 1;
+                break;
+            case 'z': level = std::max(0, std::min(atoi(optarg), 9)); break;
+            case 't': numThreads = atoi(optarg); break;
+            case 'c': resume = 1; break;
+            default:  usage(); return 1;
+        }
+    }
+    if (argc - optind != 2) { usage(); return 1; }
+    inputName = argv[optind];
+    outputName = argv[optind+1];
+
+    if (formatName == NULL) {
+        const char *ext = strrchr(outputName, '.');
+        format = (ext && (!strcmp(ext, ".h5") || !strcmp(ext, ".hdf5"))) ? formatHDF5 : formatTIFF;
+    } else if (!strcmp(formatName, "hdf5")) {
+        format = formatHDF5;
+    } else if (!strcmp(formatName, "tiff")) {
+        format = formatTIFF;
+    } else {
+        usage();
+        return 1;
+    }
+#ifndef HAVE_HDF5
+    if (format == formatHDF5) {
+        fprintf(stderr, "%s: built without HDF5 support\n", programName);
+        return 1;
+    }
+#endif
+#ifndef HAVE_TIFF
+    if (format == formatTIFF) {
+        fprintf(stderr, "%s: built without TIFF support\n", programName);
+        return 1;
+    }
+#endif
+
+    /* Parse the header and work out the frame layout */
+    p.fd = open(inputName, O_RDONLY);
+    if ((p.fd < 0) || (fstat(p.fd, &statBuf) != 0) ||
+        (pread(p.fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))) {
+        fprintf(stderr, "%s: cannot read header of %s: %s\n", programName, inputName, strerror(errno));
+        return 1;
+    }
+    p.elementSize = elementSize(header.datatype);
+    if ((p.elementSize == 0) || (header.ndims < 1) || (header.ndims > 2) || (header.datasize <= 0)) {
+        fprintf(stderr, "%s: %s is not a raw file with 1 or 2 dimensional frames\n", programName, inputName);
+        return 1;
+    }
+    p.columns = header.dims0size;
+    p.rows = (header.ndims == 2) ? header.dims1size : 1;
+    p.frameStride = roundUp(header.datasize, NDFILE_RAW_ALIGN);
+    if (p.columns*p.rows*p.elementSize > (size_t)header.datasize) {
+        fprintf(stderr, "%s: header dimensions of %s exceed the frame size\n", programName, inputName);
+        return 1;
+    }
+    numFrames = (statBuf.st_size - NDFILE_RAW_ALIGN) / (off_t)p.frameStride;
+
+    if (lastFrame < 0) lastFrame = numFrames - 1;
+    if ((firstFrame < 0) || (lastFrame >= numFrames) || (firstFrame > lastFrame)) {
+        fprintf(stderr, "%s: frame range %ld:%ld is outside the %ld frames in %s\n",
+                programName, firstFrame, lastFrame, numFrames, inputName);
+        return 1;
+    }
+    if (!haveRoi) {
+        roi[2] = p.columns;
+        roi[3] = p.rows;
+    }
+    if ((roi[0] < 0) || (roi[1] < 0) || (roi[2] <= 0) || (roi[3] <= 0) ||
+        ((size_t)(roi[0] + roi[2]) > p.columns) || ((size_t)(roi[1] + roi[3]) > p.rows)) {
+        fprintf(stderr, "%s: ROI is outside the %lux%lu frame\n", programName,
+                (unsigned long)p.columns, (unsigned long)p.rows);
+        return 1;
+    }
+    p.roiX = roi[0];
+    p.roiY = roi[1];
+    p.roiWidth = roi[2];
+    p.roiHeight = roi[3];
+
+    /* Open the output, skipping frames already converted when resuming */
+    long startFrame = firstFrame;
+#ifdef HAVE_HDF5
+    rawConvertHDF5_t hdf5;
+    if (format == formatHDF5) {
+        if (openHDF5(&hdf5, outputName, header.datatype, firstFrame, p.roiWidth, p.roiHeight,
+                     roi, &level, resume)) {
+            fprintf(stderr, "%s: cannot open %s\n", programName, outputName);
+            return 1;
+        }
+        startFrame = firstFrame + (long)hdf5.numWritten;
+    }
+#endif
+#ifdef HAVE_TIFF
+    if (format == formatTIFF) {
+        if ((mkdir(outputName, 0777) != 0) && (errno != EEXIST)) {
+            fprintf(stderr, "%s: cannot create %s: %s\n", programName, outputName, strerror(errno));
+            return 1;
+        }
+        if (resume) startFrame = firstMissingTIFF(outputName, firstFrame, lastFrame);
+    }
+#endif
+    if (startFrame > firstFrame) {
+        printf("%s: resuming at frame %ld\n", programName, startFrame);
+    }
+
+    /* Start the pipeline */
+    if (numThreads < 1) numThreads = 1;
+    int numBuffers = 2*numThreads + 2;
+    size_t frameBytes = p.roiWidth * p.roiHeight * p.elementSize;
+    p.bufferSize = p.roiHeight * p.columns * p.elementSize;
+    p.level = (format == formatHDF5) ? level : 0;
+    p.tiffDir = (format == formatTIFF) ? outputName : NULL;
+    p.dataType = header.datatype;
+    size_t bufferSize = p.bufferSize + ((p.level > 0) ? compressBound(frameBytes) : 0);
+    p.nextFrame = startFrame;
+    p.lastFrame = lastFrame;
+    p.numWorkers = numThreads;
+    p.doneEvent = epicsEventMustCreate(epicsEventEmpty);
+    p.pLock = new epicsMutex();
+    p.pFreeQueue = new epicsMessageQueue(numBuffers, sizeof(char *));
+    p.pDoneQueue = new epicsMessageQueue(numBuffers, sizeof(rawConvertJob_t));
+    for (i=0; i<numBuffers; i++) {
+        char *pBuf = (char *)malloc(bufferSize);
+        if (pBuf == NULL) {
+            fprintf(stderr, "%s: cannot allocate %lu byte frame buffers\n", programName, (unsigned long)bufferSize);
+            return 1;
+        }
+        p.pFreeQueue->send(&pBuf, sizeof(pBuf));
+    }
+    for (i=0; i<numThreads; i++) {
+        epicsThreadCreate("rawConvertWorker", epicsThreadPriorityMedium,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          (EPICSTHREADFUNC)workerTask, &p);
+    }
+
+    /* Write frames in order as they arrive, reporting throughput about once a second.  TIFF frames
+     * are already written and only counted, in order, so that progress has no gaps. */
+    std::map<long, rawConvertJob_t> pending;
+    rawConvertJob_t job;
+    epicsTimeStamp tStart, tLast, tNow;
+    long expected = startFrame, reported = startFrame;
+    int status = 0;
+
+    epicsTimeGetCurrent(&tStart);
+    tLast = tStart;
+    while ((expected <= lastFrame) && (status == 0)) {
+        p.pDoneQueue->receive(&job, sizeof(job));
+        if (job.pData == NULL) {
+            status = -1;
+            break;
+        }
+        pending[job.frame] = job;
+        while (!pending.empty() && (pending.begin()->first == expected)) {
+            char *pBuf = pending.begin()->second.pData;
+            size_t compressedSize = pending.begin()->second.compressedSize;
+            int written = pending.begin()->second.written;
+            pending.erase(pending.begin());
+            if (written) {
+                expected++;
+                continue;
+            }
+#ifdef HAVE_HDF5
+            if (format == formatHDF5) status = writeHDF5(&hdf5, compressedSize ? pBuf + p.bufferSize : pBuf,
+                                                         compressedSize, p.roiWidth, p.roiHeight);
+#endif
+            p.pFreeQueue->send(&pBuf, sizeof(pBuf));
+            if (status) {
+                fprintf(stderr, "%s: error writing frame %ld\n", programName, expected);
+                break;
+            }
+            expected++;
+        }
+        epicsTimeGetCurrent(&tNow);
+        double interval = epicsTimeDiffInSeconds(&tNow, &tLast);
+        if (interval >= 1.0) {
+            double rate = (expected - reported) / interval;
+            printf("%s: frame %ld/%ld, %.1f frames/s, %.1f MB/s\n", programName, expected - 1, lastFrame,
+                   rate, rate*frameBytes/(1024.*1024.));
+            tLast = tNow;
+            reported = expected;
+        }
+    }
+
+    if (status == 0) epicsEventWait(p.doneEvent);
+#ifdef HAVE_HDF5
+    if (format == formatHDF5) closeHDF5(&hdf5);
+#endif
+    close(p.fd);
+
+    epicsTimeGetCurrent(&tNow);
+    double elapsed = epicsTimeDiffInSeconds(&tNow, &tStart);
+    long converted = expected - startFrame;
+    if (elapsed <= 0.) elapsed = 1e-9;
+    printf("%s: converted %ld frames in %.2f s, %.1f frames/s, %.1f MB/s\n", programName, converted, elapsed,
+           converted/elapsed, converted*frameBytes/elapsed/(1024.*1024.));
+
+    return status ? 1 : 0;
+}
@@ -0,0 +1,635 @@
+/* testNDFileRaw.cpp
+ * Unit tests for NDFileRaw.
+ *
+ * Frames are produced by several threads and written through NDFileRaw::writeFile, with the
+ * file I/O replaced by a backend that can inject short writes, EINTR, ENOSPC and latency
+ * spikes.  Every file written is read back and checked byte for byte.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <vector>
+#include <set>
+
+#include <epicsThread.h>
+#include <epicsMessageQueue.h>
+#include <epicsEvent.h>
+#include <epicsTime.h>
+#include <epicsStdio.h>
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "NDFileRaw.h"
+#include "NDFileRawFormat.h"
+
+#define XSIZE          300     /* 300x301 UInt16 frames are not a multiple of 512 bytes, so padding is tested */
+#define YSIZE          301
+#define NUM_PRODUCERS  3
+#define QUEUE_SIZE     20
+#define SPILL_DIR      "testNDFileRawSpill"
+
+static const size_t frameSize = XSIZE*YSIZE*sizeof(epicsUInt16);
+static const size_t frameStride = (frameSize + NDFILE_RAW_ALIGN - 1) & ~(size_t)(NDFILE_RAW_ALIGN - 1);
+
+/* NDFileRaw with access to its NDArray pool */
+class NDFileRawTest : public NDFileRaw
+{
+public:
+    NDFileRawTest() : NDFileRaw("RAWTEST", QUEUE_SIZE, 0, "", 0, 0, 0) {}
+    NDArrayPool *pool() { return this->pNDArrayPool; }
+};
+
+static NDFileRawTest *pPlugin;
+
+static int findIndex(const char *name)
+{
+    int index;
+
+    if (pPlugin->findParam(name, &index) != asynSuccess)
+        testAbort("no parameter %s", name);
+    return index;
+}
+
+static void setInt(const char *name, int value)
+{
+    int index = findIndex(name);
+
+    pPlugin->lock();
+    pPlugin->setIntegerParam(index, value);
+    pPlugin->unlock();
+}
+
+static int getInt(const char *name)
+{
+    int index = findIndex(name), value;
+
+    pPlugin->lock();
+    pPlugin->getIntegerParam(index, &value);
+    pPlugin->unlock();
+    return value;
+}
+
+static void setDouble(const char *name, double value)
+{
+    int index = findIndex(name);
+
+    pPlugin->lock();
+    pPlugin->setDoubleParam(index, value);
+    pPlugin->unlock();
+}
+
+static void setString(const char *name, const char *value)
+{
+    int index = findIndex(name);
+
+    pPlugin->lock();
+    pPlugin->setStringParam(index, value);
+    pPlugin->unlock();
+}
+
+
+/* Fault injecting I/O backend.  Everything is forwarded to NDFileRawSystemIO after the
+ * configured faults are applied. */
+static struct {
+    int shortWrites;        /* Write at most this many 512 byte blocks per call, 0=no limit */
+    int eintrEvery;         /* Fail every Nth write with EINTR before writing anything, 0=never */
+    off_t enospcAfter;      /* Fail primary file writes with ENOSPC once this many bytes are written, 0=never */
+    int failBuffered;       /* Fail writes to files without O_DIRECT (the spill file) with ENOSPC ... */
+    int okBuffered;         /* ... after this many have succeeded */
+    int allocateError;      /* errno returned by allocate, 0=none */
+    double stall;           /* Seconds the first primary file write at or after stallAt blocks for */
+    off_t stallAt;
+    int slowDownInStall;    /* NDFileRawBPSlowDown as seen from the end of the stall */
+
+    int writes;
+    int buffered;
+    int eintrs;
+    int shorts;
+    int syncs;
+    off_t primaryBytes;
+} faults;
+
+static void resetFaults()
+{
+    memset(&faults, 0, sizeof(faults));
+}
+
+static void doStall()
+{
+    double slept = 0.;
+
+    if ((faults.stall <= 0.) || (faults.primaryBytes < faults.stallAt)) return;
+    while (slept < faults.stall)
+    {
+        epicsThreadSleep(0.01);
+        slept += 0.01;
+    }
+    faults.stall = 0.;
+    faults.slowDownInStall = getInt(NDFileRawBPSlowDownString);
+}
+
+static ssize_t faultWrite(int fd, const void *pData, size_t nbytes)
+{
+    int primary = (fcntl(fd, F_GETFL) & O_DIRECT) != 0;
+    ssize_t n;
+
+    faults.writes++;
+    if (faults.eintrEvery && (faults.writes % faults.eintrEvery == 0))
+    {
+        faults.eintrs++;
+        errno = EINTR;
+        return -1;
+    }
+    if (!primary && faults.failBuffered && (faults.buffered++ >= faults.okBuffered))
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (primary)
+    {
+        doStall();
+        if (faults.enospcAfter)
+        {
+            if (faults.primaryBytes >= faults.enospcAfter)
+            {
+                errno = ENOSPC;
+                return -1;
+            }
+            if (nbytes > (size_t)(faults.enospcAfter - faults.primaryBytes))
+                nbytes = faults.enospcAfter - faults.primaryBytes;
+        }
+    }
+    if (faults.shortWrites && (nbytes > (size_t)faults.shortWrites*NDFILE_RAW_ALIGN))
+    {
+        faults.shorts++;
+        nbytes = faults.shortWrites*NDFILE_RAW_ALIGN;
+    }
+
+    n = NDFileRawSystemIO.write(fd, pData, nbytes);
+    if (primary && (n > 0)) faults.primaryBytes += n;
+    return n;
+}
+
+static int faultAllocate(int fd, off_t offset, off_t length)
+{
+    if (faults.allocateError) return faults.allocateError;
+    return NDFileRawSystemIO.allocate(fd, offset, length);
+}
+
+static void *faultMap(size_t length, int fd, off_t offset)
+{
+    return NDFileRawSystemIO.map(length, fd, offset);
+}
+
+static int faultUnmap(void *pMap, size_t length)
+{
+    return NDFileRawSystemIO.unmap(pMap, length);
+}
+
+static int faultSyncRange(int fd, off_t offset, off_t nbytes, unsigned int flags)
+{
+    faults.syncs++;
+    return NDFileRawSystemIO.syncRange(fd, offset, nbytes, flags);
+}
+
+static const NDFileRawIO_t faultIO = {
+    faultWrite,
+    faultAllocate,
+    faultMap,
+    faultUnmap,
+    faultSyncRange
+};
+
+
+/* Frame contents: the first pixel is the uniqueId, the rest a pattern derived from it */
+static void fillFrame(NDArray *pArray, int uniqueId)
+{
+    epicsUInt16 *pData = (epicsUInt16 *)pArray->pData;
+    size_t i;
+
+    pData[0] = (epicsUInt16)uniqueId;
+    for (i = 1; i < XSIZE*YSIZE; i++)
+        pData[i] = (epicsUInt16)(uniqueId*7919 + i);
+    pArray->uniqueId = uniqueId;
+}
+
+static NDArray *allocFrame()
+{
+    size_t dims[2] = {XSIZE, YSIZE};
+    NDArray *pArray;
+
+    // The pool may be capped, so wait for the writer to release an array
+    while ((pArray = pPlugin->pool()->alloc(2, dims, NDUInt16, 0, NULL)) == NULL)
+        epicsThreadSleep(0.001);
+    return pArray;
+}
+
+typedef struct {
+    epicsMessageQueue *pQueue;
+    int first;
+    int numFrames;
+    epicsEventId doneEvent;
+} producer_t;
+
+/* Produces uniqueIds first, first+NUM_PRODUCERS, ... below numFrames */
+static void producerTask(void *arg)
+{
+    producer_t *pProducer = (producer_t *)arg;
+    int uniqueId;
+
+    for (uniqueId = pProducer->first; uniqueId < pProducer->numFrames; uniqueId += NUM_PRODUCERS)
+    {
+        NDArray *pArray = allocFrame();
+        fillFrame(pArray, uniqueId);
+        pProducer->pQueue->send(&pArray, sizeof(pArray));
+    }
+    epicsEventSignal(pProducer->doneEvent);
+}
+
+/* Opens fileName, writes numFrames frames from NUM_PRODUCERS threads and closes it.  Frames with
+ * a write index in [fullFrom, fullTo) see a full plugin queue.
+ * \param[out] written uniqueIds in the order they were passed to writeFile.
+ * \param[out] pErrors Number of writeFile calls that failed.
+ * \return Seconds spent in writeFile, or -1 if openFile failed.
+ */
+static double runFrames(const char *fileName, int numFrames, int fullFrom, int fullTo,
+                        std::vector<int> &written, int *pErrors)
+{
+    epicsMessageQueue queue(8, sizeof(NDArray *));
+    producer_t producers[NUM_PRODUCERS];
+    epicsTimeStamp tStart, tEnd;
+    double seconds = 0.;
+    NDArray *pArray;
+    int i;
+
+    written.clear();
+    *pErrors = 0;
+
+    pArray = allocFrame();
+    fillFrame(pArray, -1);
+    asynStatus status = pPlugin->openFile(fileName, NDFileModeWrite | NDFileModeMultiple, pArray);
+    pArray->release();
+    if (status != asynSuccess) return -1.;
+
+    for (i = 0; i < NUM_PRODUCERS; i++)
+    {
+        producers[i].pQueue = &queue;
+        producers[i].first = i;
+        producers[i].numFrames = numFrames;
+        producers[i].doneEvent = epicsEventMustCreate(epicsEventEmpty);
+        epicsThreadCreate("testNDFileRawProducer", epicsThreadPriorityMedium,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          producerTask, &producers[i]);
+    }
+
+    setInt(NDPluginDriverQueueSizeString, QUEUE_SIZE);
+    for (i = 0; i < numFrames; i++)
+    {
+        queue.receive(&pArray, sizeof(pArray));
+        setInt(NDPluginDriverQueueFreeString, ((i >= fullFrom) && (i < fullTo)) ? 0 : QUEUE_SIZE);
+
+        epicsTimeGetCurrent(&tStart);
+        if (pPlugin->writeFile(pArray) != asynSuccess) (*pErrors)++;
+        epicsTimeGetCurrent(&tEnd);
+        seconds += epicsTimeDiffInSeconds(&tEnd, &tStart);
+
+        written.push_back(pArray->uniqueId);
+        pArray->release();
+    }
+
+    for (i = 0; i < NUM_PRODUCERS; i++)
+    {
+        epicsEventMustWait(producers[i].doneEvent);
+        epicsEventDestroy(producers[i].doneEvent);
+    }
+
+    pPlugin->closeFile();
+    return seconds;
+}
+
+/* Reads a raw file back, checking the header, every frame against fillFrame and the padding.
+ * \param[out] ids uniqueIds of the frames found, in file order.
+ * \return 1 if the file is well formed and every frame is intact.
+ */
+static int readBack(const char *fileName, std::vector<int> &ids)
+{
+    std::vector<char> frame(frameStride);
+    fullheader header;
+    struct stat st;
+    int ok = 1;
+    FILE *fp;
+
+    ids.clear();
+    if ((stat(fileName, &st) != 0) || ((fp = fopen(fileName, "rb")) == NULL))
+    {
+        testDiag("cannot open %s", fileName);
+        return 0;
+    }
+    if ((size_t)(st.st_size - sizeof(header)) % frameStride != 0)
+    {
+        testDiag("%s is %ld bytes, not a whole number of frames", fileName, (long)st.st_size);
+        ok = 0;
+    }
+
+    if ((fread(&header, sizeof(header), 1, fp) != 1) ||
+        (header.datatype != NDUInt16) || (header.ndims != 2) ||
+        (header.dims0size != XSIZE) || (header.dims1size != YSIZE) ||
+        (header.datasize != (int)frameSize) || (header.constant1 != 123456))
+    {
+        testDiag("%s has a bad header", fileName);
+        ok = 0;
+    }
+
+    while (fread(&frame[0], frameStride, 1, fp) == 1)
+    {
+        epicsUInt16 *pData = (epicsUInt16 *)&frame[0];
+        int uniqueId = pData[0];
+        size_t i;
+
+        for (i = 1; i < XSIZE*YSIZE; i++)
+        {
+            if (pData[i] != (epicsUInt16)(uniqueId*7919 + i)) break;
+        }
+        for (i = (i == XSIZE*YSIZE) ? frameSize : 0; i < frameStride; i++)
+        {
+            if (frame[i] != 0) break;
+        }
+        if (i != frameStride)
+        {
+            testDiag("%s frame %d (uniqueId %d) is corrupt", fileName, (int)ids.size(), uniqueId);
+            ok = 0;
+        }
+        ids.push_back(uniqueId);
+    }
+
+    fclose(fp);
+    return ok;
+}
+
+/* Counts frames and transitions in the decision log for fileName with the given decision,
+ * optionally collecting their uniqueIds */
+static int countLog(const char *fileName, const char *decision, std::vector<int> *pIds = NULL)
+{
+    char logName[MAX_FILENAME_LEN], line[256], word[64];
+    int uniqueId, count = 0;
+    FILE *fp;
+
+    epicsSnprintf(logName, sizeof(logName), "%s.bplog", fileName);
+    if ((fp = fopen(logName, "r")) == NULL) return -1;
+    while (fgets(line, sizeof(line), fp))
+    {
+        if ((line[0] != '#') && (sscanf(line, "%d %63s", &uniqueId, word) == 2) && (strcmp(word, decision) == 0))
+        {
+            count++;
+            if (pIds) pIds->push_back(uniqueId);
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+/* Returns 1 if a comment line of the decision log for fileName contains text */
+static int logNote(const char *fileName, const char *text)
+{
+    char logName[MAX_FILENAME_LEN], line[256];
+    int found = 0;
+    FILE *fp;
+
+    epicsSnprintf(logName, sizeof(logName), "%s.bplog", fileName);
+    if ((fp = fopen(logName, "r")) == NULL) return 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        if ((line[0] == '#') && strstr(line, text)) found = 1;
+    }
+    fclose(fp);
+    return found;
+}
+
+/* Removes fileName and its decision log */
+static void removeFile(const char *fileName)
+{
+    char logName[MAX_FILENAME_LEN];
+
+    epicsSnprintf(logName, sizeof(logName), "%s.bplog", fileName);
+    remove(fileName);
+    remove(logName);
+}
+
+/* The frames of written that are not in dropped, in order */
+static std::vector<int> without(const std::vector<int> &written, const std::vector<int> &dropped)
+{
+    std::set<int> drop(dropped.begin(), dropped.end());
+    std::vector<int> kept;
+
+    for (size_t i = 0; i < written.size(); i++)
+    {
+        if (!drop.count(written[i])) kept.push_back(written[i]);
+    }
+    return kept;
+}
+
+static void setupFile(int mode, int policy)
+{
+    setInt(NDFileRawOutputModeString, mode);
+    setInt(NDFileRawMmapWindowString, 1);
+    setInt(NDFileRawMmapSyncIntervalString, 1);
+    setInt(NDFileRawBPPolicyString, policy);
+    setDouble(NDFileRawBPLatencyLimitString, 50.);
+    setInt(NDFileRawBPQueueLimitString, 80);
+    setInt(NDFileRawBPDecimationString, 2);
+    setInt(NDFileRawBPProbeIntervalString, 10);
+    setString(NDFileRawBPSpillPathString, SPILL_DIR);
+    resetFaults();
+}
+
+static void testModes()
+{
+    static const int modes[] = {NDFileRawModeDirect, NDFileRawModeMmap};
+    static const char *modeNames[] = {"Direct", "Mmap"};
+    std::vector<int> written, ids;
+    int m, errors, numFrames = 60;
+
+    for (m = 0; m < 2; m++)
+    {
+        const char *fileName = "testNDFileRawMode.raw";
+
+        testDiag("%s output, system I/O", modeNames[m]);
+        setupFile(modes[m], NDFileRawBPOff);
+        pPlugin->setIO(NULL);
+        double seconds = runFrames(fileName, numFrames, 0, 0, written, &errors);
+        testOk(seconds >= 0. && errors == 0, "%s: %d frames written without errors", modeNames[m], numFrames);
+        testOk(readBack(fileName, ids) && (ids == written), "%s: file matches byte for byte", modeNames[m]);
+        if (seconds > 0.)
+            testDiag("%s: %.1f MB/s through writeFile", modeNames[m], numFrames*frameSize/seconds/(1024.*1024.));
+        if (modes[m] == NDFileRawModeMmap)
+            testOk(getInt(NDFileRawMmapRemapsString) > 1, "Mmap: %d windows mapped", getInt(NDFileRawMmapRemapsString));
+        removeFile(fileName);
+    }
+}
+
+static void testShortWrites()
+{
+    const char *fileName = "testNDFileRawShort.raw";
+    std::vector<int> written, ids;
+    int errors;
+
+    testDiag("Direct output, short writes and EINTR");
+    setupFile(NDFileRawModeDirect, NDFileRawBPOff);
+    faults.shortWrites = 7;
+    faults.eintrEvery = 5;
+    pPlugin->setIO(&faultIO);
+    double seconds = runFrames(fileName, 30, 0, 0, written, &errors);
+    testOk(seconds >= 0. && errors == 0, "30 frames written without errors");
+    testOk(faults.shorts > 0 && faults.eintrs > 0, "%d short writes and %d EINTRs injected", faults.shorts, faults.eintrs);
+    testOk(readBack(fileName, ids) && (ids == written), "file matches byte for byte");
+    if (seconds > 0.)
+        testDiag("%.1f MB/s through writeFile", 30*frameSize/seconds/(1024.*1024.));
+    removeFile(fileName);
+
+    testDiag("Mmap output, writeback through the backend");
+    setupFile(NDFileRawModeMmap, NDFileRawBPOff);
+    pPlugin->setIO(&faultIO);
+    seconds = runFrames(fileName, 30, 0, 0, written, &errors);
+    testOk(seconds >= 0. && errors == 0, "30 frames written without errors");
+    testOk(faults.syncs > 0, "%d sync_file_range calls", faults.syncs);
+    testOk(readBack(fileName, ids) && (ids == written), "file matches byte for byte");
+    removeFile(fileName);
+}
+
+static void testNoSpace()
+{
+    const char *fileName = "testNDFileRawFull.raw";
+    std::vector<int> written, ids;
+    struct stat st;
+    int errors;
+
+    testDiag("Direct output, ENOSPC part way through a frame");
+    setupFile(NDFileRawModeDirect, NDFileRawBPOff);
+    faults.enospcAfter = sizeof(fullheader) + 5*frameStride + 2*NDFILE_RAW_ALIGN;
+    pPlugin->setIO(&faultIO);
+    runFrames(fileName, 10, 0, 0, written, &errors);
+    testOk(errors == 5, "last %d of 10 frames failed", errors);
+    testOk(stat(fileName, &st) == 0 && st.st_size == (off_t)(sizeof(fullheader) + 5*frameStride),
+           "file ends after the last whole frame");
+    testOk(readBack(fileName, ids) && (ids.size() == 5) &&
+           std::vector<int>(written.begin(), written.begin() + 5) == ids, "frames before it are intact");
+    removeFile(fileName);
+
+    testDiag("Mmap output, preallocation fails");
+    setupFile(NDFileRawModeMmap, NDFileRawBPOff);
+    faults.allocateError = ENOSPC;
+    pPlugin->setIO(&faultIO);
+    testOk(runFrames(fileName, 1, 0, 0, written, &errors) < 0., "openFile fails");
+    removeFile(fileName);
+}
+
+static void testDecimate()
+{
+    const char *fileName = "testNDFileRawDecimate.raw";
+    std::vector<int> written, ids, skipped;
+    int errors;
+
+    testDiag("Decimate policy with a full queue");
+    setupFile(NDFileRawModeDirect, NDFileRawBPDecimate);
+    pPlugin->setIO(&faultIO);
+    runFrames(fileName, 30, 10, 20, written, &errors);
+    testOk(errors == 0 && getInt(NDFileRawBPSkippedString) == 5, "%d frames skipped", getInt(NDFileRawBPSkippedString));
+    testOk(countLog(fileName, "skip", &skipped) == 5, "skips logged");
+    testOk(readBack(fileName, ids) && (ids == without(written, skipped)), "remaining frames match byte for byte");
+    removeFile(fileName);
+}
+
+static void testStall()
+{
+    const char *fileName = "testNDFileRawStall.raw";
+    char spillName[MAX_FILENAME_LEN];
+    std::vector<int> written, ids, spillIds, spilled;
+    int errors;
+
+    testDiag("Spill policy, a single write stalls for 300 ms");
+    epicsSnprintf(spillName, sizeof(spillName), "%s/%s.spill", SPILL_DIR, fileName);
+    setupFile(NDFileRawModeDirect, NDFileRawBPSpill);
+    setInt(NDFileRawBPQueueLimitString, 0);
+    pPlugin->setIO(&faultIO);
+    faults.stall = 0.3;
+    faults.stallAt = sizeof(fullheader) + 3*frameStride;
+    runFrames(fileName, 80, 0, 0, written, &errors);
+    testOk(faults.slowDownInStall == 1, "BPSlowDown set while the write was still blocked");
+    testOk(countLog(fileName, "stalled") == 1, "stall logged by the watchdog");
+    testOk(countLog(fileName, "behind") == 0, "writer did not detect it itself");
+    testOk(errors == 0 && getInt(NDFileRawBPSpilledString) > 0, "%d frames spilled", getInt(NDFileRawBPSpilledString));
+    testOk(countLog(fileName, "probe") > 0, "%d probe frames written to the primary file", countLog(fileName, "probe"));
+    testOk(countLog(fileName, "caughtup") == 1, "caught up once the probes measured the disk");
+
+    countLog(fileName, "spill", &spilled);
+    testOk(readBack(spillName, spillIds) && (spillIds == spilled), "spill file matches byte for byte");
+    testOk(readBack(fileName, ids) && (ids == without(written, spilled)), "primary file matches byte for byte");
+    removeFile(fileName);
+    remove(spillName);
+}
+
+static void testSpillFailures()
+{
+    const char *fileName = "testNDFileRawSpill.raw";
+    char spillName[MAX_FILENAME_LEN];
+    std::vector<int> written, ids;
+    int errors;
+
+    epicsSnprintf(spillName, sizeof(spillName), "%s/%s.spill", SPILL_DIR, fileName);
+
+    testDiag("Spill policy, spill writes fail after the header");
+    setupFile(NDFileRawModeDirect, NDFileRawBPSpill);
+    faults.failBuffered = 1;
+    faults.okBuffered = 1;
+    pPlugin->setIO(&faultIO);
+    runFrames(fileName, 30, 5, 20, written, &errors);
+    testOk(getInt(NDFileRawBPSpilledString) == 0 && countLog(fileName, "spillfailed") == 1, "failed spill logged, not counted");
+    testOk(logNote(fileName, "spill write failed"), "falls back to Signal");
+    testOk(errors == 0 && readBack(fileName, ids) && (ids == written), "every frame written to the primary file");
+    removeFile(fileName);
+    remove(spillName);
+
+    testDiag("Spill policy, spill file cannot be written");
+    setupFile(NDFileRawModeDirect, NDFileRawBPSpill);
+    faults.failBuffered = 1;
+    pPlugin->setIO(&faultIO);
+    runFrames(fileName, 20, 5, 12, written, &errors);
+    testOk(logNote(fileName, "cannot create spill file"), "falls back to Signal");
+    testOk(errors == 0 && readBack(fileName, ids) && (ids == written), "all frames written to the primary file");
+    removeFile(fileName);
+    remove(spillName);
+
+    testDiag("Spill policy, no spill path");
+    setupFile(NDFileRawModeDirect, NDFileRawBPSpill);
+    setString(NDFileRawBPSpillPathString, "");
+    pPlugin->setIO(&faultIO);
+    runFrames(fileName, 20, 5, 12, written, &errors);
+    testOk(logNote(fileName, "no spill path set"), "falls back to Signal");
+    testOk(countLog(fileName, "behind") == 1 && countLog(fileName, "caughtup") == 1, "behind while the queue was full");
+    testOk(errors == 0 && getInt(NDFileRawBPSpilledString) == 0 && readBack(fileName, ids) && (ids == written),
+           "all frames written to the primary file");
+    removeFile(fileName);
+}
+
+MAIN(testNDFileRaw)
+{
+    testPlan(34);
+
+    mkdir(SPILL_DIR, 0777);
+    pPlugin = new NDFileRawTest();
+
+    testModes();
+    testShortWrites();
+    testNoSpace();
+    testDecimate();
+    testStall();
+    testSpillFailures();
+
+    rmdir(SPILL_DIR);
+    return testDone();
+}